@@ -31,18 +31,51 @@
 
 // Modify the entry names in a zip file in place to remove directory traversal
 // vulnerabilities. This operation is destructive, so you may want to make a
-// copy of the zip file first. Any leading / is replaced by an _ . Any ..
-// components are replaced with __ .
+// copy of the zip file first, which -o can do cheaply. Any leading / or \ is
+// replaced by an _ , as is the : of a leading drive letter like C: . Any ..
+// components, delimited by / or \ , are replaced with __ . The same is done to
+// the name in an Info-ZIP Unicode path extra field, if there is one.
+//
+// Compiled with ZIPCLEAN_LIB defined, this is instead the zipclean library,
+// which cleans zip files in memory with the interface in zipclean.h.
 
+#ifdef __linux__
+#  define _GNU_SOURCE               // for copy_file_range()
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdnoreturn.h>            // assumes C11
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <strings.h>
 #include <sys/errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#ifdef __linux__
+#  include <sys/ioctl.h>
+#  include <linux/fs.h>
+#endif
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <signal.h>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#include "zipclean.h"
 
 // Zip file structure signatures, lengths, and markers.
 #define LOCAL 0x04034b50            // local entry header
@@ -50,97 +83,574 @@
 #define ZIP64LOC 0x07064b50         // zip64 end record locator
 #define ZIP64END 0x06064b50         // zip64 end record
 #define END 0x06054b50              // end of central directory record
+#define DESC 0x08074b50             // data descriptor (optional signature)
+#define DIGSIG 0x05054b50           // central directory digital signature
+#define EXTRA 0x08064b50            // archive extra data record
+#define UPATH 0x7075                // Info-ZIP Unicode path extra field ID
 #define ZLOCLEN 20                  // length of zip64 end record locator
 #define ENDLEN 22                   // length of end record
 #define MAX16 0xffff                // zip64 indication for number of entries
 #define MAX32 0xffffffff            // zip64 indication for length or offset
 
-// Zip file processing and error handling information.
+// Page size assumed for joining writes. Unchanged bytes between two names are
+// rewritten to join their writes into one only if that dirties no more pages.
+#define PAGE 4096
+// Largest gap between local headers to read through when prefetching them.
+#define AHEAD 65536
+// Largest span of local headers to prefetch or fetch remotely at once.
+#define RUN (1 << 24)
+// Alignment of the offsets, lengths, and buffers for O_DIRECT reads.
+#define DIRECT 4096
+// Fewest central directory entries for each thread when splitting one up.
+#define SPLIT 65536
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+// Name replacement for an entry, applied to its central and local headers.
+// This is either the name, or the CRC-32 and name of a Unicode path extra
+// field, in which case skip is 4 to get to the name.
+typedef struct {
+    off_t local;            // offset of the local header
+    off_t put;              // offset in the local header, or -1 if not there
+    size_t name;            // offset of the name in the central directory
+    unsigned nlen;          // length of the name
+    unsigned skip;          // bytes before the name, for the CRC-32
+    size_t repl;            // offset of the replacement name in the arena
+    off_t data;             // least end of the entry data, for --overlap, or
+                            // the header name offset, for a Unicode path
+} patch_t;
+
+// Growable buffer.
+typedef struct {
+    unsigned char *buf;     // allocated memory
+    size_t size;            // allocated size of buf[]
+    size_t len;             // number of bytes in use in buf[]
+} buf_t;
+
+// Scratch memory for processing zip files, owned by one thread. Each buffer is
+// grown as needed and is kept for the next zip file, so that once the buffers
+// are large enough, nothing is allocated or freed.
+typedef struct {
+    buf_t dir;              // central directory, if not mapped
+    buf_t tmp;              // end record search window or local header
+    buf_t repl;             // replacement names
+    buf_t patch;            // list of name replacements
+    buf_t check;            // list of local headers to verify
+    buf_t seen;             // hash set of the final names, for --collisions
+    buf_t out;              // report
+} arena_t;
+
+// Counts and times for the zip files processed.
 typedef struct {
+    uintmax_t files;        // number of zip files
+    uintmax_t bytes;        // total length of the zip files
+    uintmax_t entries;      // number of entries scanned
+    uintmax_t fixed;        // number of entries with names to fix
+    uintmax_t errors;       // number of zip files skipped due to errors
+    uintmax_t cached;       // number of zip files known to be clean already
+    uintmax_t reads;        // number of reads from the file
+    uintmax_t seeks;        // number of seeks in the file
+    uintmax_t writes;       // number of writes to the file
+    uintmax_t calls;        // number of other I/O system calls
+    uintmax_t got;          // number of bytes read or accessed in the mapping
+    uintmax_t put;          // number of bytes written
+    double end;             // seconds spent looking for the end record
+    double dir;             // seconds spent loading and scanning the directory
+    double local;           // seconds spent on the local headers
+} tally_t;
+
+// Limits on the work done for each zip file, so that a hostile zip file is
+// given up on quickly. Zero is no limit.
+typedef struct {
+    uint64_t entries;       // most entries in the central directory
+    uintmax_t bytes;        // most bytes read or accessed in the mapping
+    double time;            // most seconds to spend
+} budget_t;
+
+// Settings for processing zip files, from the command line. These are kept in
+// work_t for all of the threads, and copied to job_t and zip_t for each thread
+// and zip file, which may modify them for their own use.
+typedef struct {
+    int fix;                // true to write fixed names
+    int stats;              // true to report the counts for each zip file
+    int json;               // true to report in JSON Lines format
+    int quick;              // true to stop at the first name to fix
+    int verify;             // true to check all of the local headers
+    int overlap;            // true to check for overlapping entries
+    int collide;            // true to check for fixed names that collide
+    int drop;               // true to drop the zip file from the page cache
+    int direct;             // true to read the central directory with O_DIRECT
+    int hint;               // true to prefetch the local headers
+    int stdio;              // true to read with stdio instead of mmap()
+    int split;              // number of threads for a large directory
+    char *copy;             // path of a fixed copy to write, or NULL
+    int keep;               // true to journal the names before replacing them
+    budget_t max;           // limits for each zip file
+} opts_t;
+
+// Settings and resources for processing zip files, one set per thread.
+typedef struct {
+    opts_t opt;             // settings
+    FILE *log;              // where to write reports, or NULL to discard
+    int fd;                 // descriptor of the zip file to use, or -1
+    struct cache_s *cache;  // clean zip files from before, or NULL
+    struct net_s *net;      // connection for remote zip files, or NULL
+    buf_t save;             // clean zip files to add to the cache
+    arena_t mem;            // scratch memory
+    tally_t sum;            // totals for the zip files processed
+} job_t;
+
+// Zip file processing and error handling information.
+typedef struct zip_s {
     char *path;             // zip file path
     FILE *in;               // open zip file for reading and writing
-    int fix;                // true to write fixed names
+    unsigned char *map;     // read-only mapping of the zip file, or NULL --
+                            // or the zip file in memory if in is NULL
+    off_t size;             // length of the zip file
+    struct stat st;         // status of the zip file, if it's a regular file
+    opts_t opt;             // settings for this zip file
     int mod;                // true if modified
-    unsigned char *name;    // allocated name
-    unsigned char *repl;    // allocated replacement name
-    unsigned char *extra;   // allocated central header extra field
+    int probe;              // true if not known to be a zip file yet
+    double due;             // time to give up by, or zero for no limit
+    void (*keep)(struct zip_s *);   // saves the names to be replaced, or NULL
+    unsigned char const *(*get)(struct zip_s *, off_t, size_t,
+                                unsigned char *);   // remote reader, or NULL
+    struct net_s *net;      // connection for get()
+    int dest;               // descriptor of the copy, or -1 if not open
+    char *fail;             // where to put an error message, or NULL
+    int err;                // ZIPCLEAN_E* error for zipclean_buffer()
+    zipclean_report_t *report;  // zipclean_buffer() callback, or NULL
+    void *opaque;           // argument for report()
+    FILE *log;              // where to write the report, or NULL
+    arena_t *mem;           // scratch memory
+    tally_t count;          // counts for this zip file
+    tally_t *sum;           // where to add the counts, or NULL
+    unsigned char const *dir;   // central directory (in map[] or mem->dir)
+    size_t len;             // length of the central directory
+    size_t pos;             // offset of the next header in dir[]
+    size_t last;            // offset of the last header scanned in dir[]
+    off_t beg;              // offset of the central directory in the file
+    off_t end;              // offset of the end record in the file
+    unsigned char const *name;  // name of the current entry (in dir[])
+    unsigned char const *extra; // central header extra field (in dir[])
+    patch_t *patch;         // list of name replacements (in mem->patch)
+    size_t num;             // number of patches in patch[]
     jmp_buf env;            // longjmp destination for errors
 } zip_t;
 
+// Make sure that b has room for more bytes after the b->len in use. Return 0
+// on success, or -1 if out of memory, in which case b is unchanged.
+static int fits(buf_t *b, size_t more) {
+    if (b->size - b->len >= more)
+        return 0;
+    if (SIZE_MAX - b->len < more)
+        return -1;
+    size_t size = b->size ? b->size : 4096;
+    while (size - b->len < more)
+        size = size > SIZE_MAX / 2 ? SIZE_MAX : size << 1;
+    void *buf = realloc(b->buf, size);
+    if (buf == NULL)
+        return -1;
+    b->buf = buf;
+    b->size = size;
+    return 0;
+}
+
+// Release the memory in the arena.
+static void arena_free(arena_t *mem) {
+    free(mem->dir.buf);
+    free(mem->tmp.buf);
+    free(mem->repl.buf);
+    free(mem->patch.buf);
+    free(mem->check.buf);
+    free(mem->seen.buf);
+    free(mem->out.buf);
+}
+
+// Lock for writing reports to stdout and stderr, so that the reports for zip
+// files processed in parallel are not interleaved.
+static pthread_mutex_t report = PTHREAD_MUTEX_INITIALIZER;
+
+// Write the report for zip->path to zip->log, followed by msg to stderr if msg
+// is not NULL, with nothing from other threads in between. A log other than
+// stdout or stderr belongs to this thread, and so needs no lock if nothing
+// goes to stderr. If zip->path is still just being probed for zipness, then
+// don't complain about it.
+static void zip_flush(zip_t *zip, char const *msg) {
+    buf_t *out = &zip->mem->out;
+    int own = zip->log != stdout && zip->log != stderr &&
+              (msg == NULL || zip->probe || zip->opt.json);
+    if (!own)
+        pthread_mutex_lock(&report);
+    if (zip->log != NULL && out->len) {
+        fwrite(out->buf, 1, out->len, zip->log);
+        fflush(zip->log);
+    }
+    if (msg != NULL && !zip->probe && !zip->opt.json)
+        fprintf(stderr, "zipclean: %s %s -- skipping%s\n",
+                msg, zip->path, zip->mod ? " (modified)" : "");
+    if (!own)
+        pthread_mutex_unlock(&report);
+    out->len = 0;
+}
+
+// Append a formatted line to the report for zip->path. If there isn't enough
+// memory to hold it, then write out what's there and print this one directly.
+static void say(zip_t *zip, char const *fmt, ...) {
+    buf_t *out = &zip->mem->out;
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf((char *)out->buf + out->len, out->size - out->len,
+                        fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        return;
+    if ((size_t)len >= out->size - out->len) {
+        if (fits(out, (size_t)len + 1)) {
+            zip_flush(zip, NULL);
+            va_start(ap, fmt);
+            pthread_mutex_lock(&report);
+            if (zip->log != NULL)
+                vfprintf(zip->log, fmt, ap);
+            pthread_mutex_unlock(&report);
+            va_end(ap);
+            return;
+        }
+        va_start(ap, fmt);
+        vsnprintf((char *)out->buf + out->len, out->size - out->len, fmt, ap);
+        va_end(ap);
+    }
+    out->len += len;
+}
+
+// Write the bytes of str[0..len-1] to dst[] as the contents of a JSON string.
+// Quotes, backslashes, and control characters are escaped, as are bytes that
+// are not part of a valid UTF-8 sequence, which are written as the code point
+// of the same value. dst[] must have room for 6 * len bytes. Return the number
+// of bytes written.
+static size_t json_str(unsigned char *dst, unsigned char const *str,
+                       size_t len) {
+    static char const hex[] = "0123456789abcdef";
+    unsigned char *p = dst;
+    size_t i = 0;
+    while (i < len) {
+        unsigned ch = str[i];
+        if (ch >= 0x20 && ch < 0x7f && ch != '"' && ch != '\\') {
+            *p++ = ch;
+            i++;
+            continue;
+        }
+        if (ch >= 0xc2 && ch < 0xf5) {
+            // Copy a valid UTF-8 sequence as is. Overlong encodings,
+            // surrogates, and code points past U+10FFFF are not valid.
+            size_t n = ch < 0xe0 ? 2 : ch < 0xf0 ? 3 : 4, k = 1;
+            while (k < n && i + k < len && (str[i + k] & 0xc0) == 0x80)
+                k++;
+            if (k == n &&
+                (n < 3 || ch != 0xe0 || str[i + 1] >= 0xa0) &&
+                (n < 3 || ch != 0xed || str[i + 1] < 0xa0) &&
+                (n < 4 || ((ch != 0xf0 || str[i + 1] >= 0x90) &&
+                           (ch != 0xf4 || str[i + 1] < 0x90)))) {
+                memcpy(p, str + i, n);
+                p += n;
+                i += n;
+                continue;
+            }
+        }
+        *p++ = '\\';
+        if (ch == '"' || ch == '\\')
+            *p++ = ch;
+        else {
+            *p++ = 'u';
+            *p++ = '0';
+            *p++ = '0';
+            *p++ = hex[ch >> 4];
+            *p++ = hex[ch & 0xf];
+        }
+        i++;
+    }
+    return p - dst;
+}
+
+// Append str[0..len-1] to the report for zip->path as a JSON string, or as
+// null if there isn't enough memory for it.
+static void say_str(zip_t *zip, unsigned char const *str, size_t len) {
+    buf_t *out = &zip->mem->out;
+    if (fits(out, 6 * len + 2)) {
+        say(zip, "null");
+        return;
+    }
+    unsigned char *p = out->buf + out->len;
+    *p++ = '"';
+    p += json_str(p, str, len);
+    *p++ = '"';
+    out->len = p - out->buf;
+}
+
+// Report that name[0..len-1] is fixed, or would be, as repl[0..len-1].
+static void say_fix(zip_t *zip, unsigned char const *name,
+                    unsigned char const *repl, size_t len) {
+    if (zip->opt.json) {
+        say(zip, "{\"file\":");
+        say_str(zip, (unsigned char *)zip->path, strlen(zip->path));
+        say(zip, ",\"name\":");
+        say_str(zip, name, len);
+        say(zip, ",\"fixed\":");
+        say_str(zip, repl, len);
+        say(zip, "}\n");
+    }
+    else
+        say(zip, "%s: %.*s -> %.*s\n",
+            zip->path, (int)len, name, (int)len, repl);
+}
+
+// Return the current time in seconds, for timing.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Add the counts and times in add to sum.
+static void tally_add(tally_t *sum, tally_t const *add) {
+    sum->files += add->files;
+    sum->bytes += add->bytes;
+    sum->entries += add->entries;
+    sum->fixed += add->fixed;
+    sum->errors += add->errors;
+    sum->cached += add->cached;
+    sum->reads += add->reads;
+    sum->seeks += add->seeks;
+    sum->writes += add->writes;
+    sum->calls += add->calls;
+    sum->got += add->got;
+    sum->put += add->put;
+    sum->end += add->end;
+    sum->dir += add->dir;
+    sum->local += add->local;
+}
+
+// Write the counts and times in t to buf[0..size-1] as a line of text, or as
+// JSON object members if json is true.
+static void tally_line(char *buf, size_t size, tally_t const *t, int json) {
+    snprintf(buf, size, json ?
+             "\"entries\":%ju,\"fixed\":%ju,\"reads\":%ju,\"seeks\":%ju,"
+             "\"writes\":%ju,\"calls\":%ju,\"read\":%ju,\"written\":%ju,"
+             "\"end\":%.6f,\"dir\":%.6f,\"local\":%.6f" :
+             "%ju entries, %ju fixed, %ju reads, %ju seeks, "
+             "%ju writes, %ju other calls, %ju bytes read, %ju bytes written, "
+             "%.6f s end search, %.6f s directory, %.6f s local headers",
+             t->entries, t->fixed, t->reads, t->seeks, t->writes, t->calls,
+             t->got, t->put, t->end, t->dir, t->local);
+}
+
+// Tell the kernel that the len bytes at offset at in the file fd will be read
+// soon, or if drop is true, that they won't be read again and can be dropped
+// from the page cache. This is only a hint, so where there's no way to give
+// it, nothing is done. macOS has F_RDADVISE to read ahead, but nothing for
+// dropping pages.
+static void advise(int fd, off_t at, off_t len, int drop) {
+#if defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(fd, at, len,
+                  drop ? POSIX_FADV_DONTNEED : POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    if (!drop) {
+        struct radvisory ra = {at, len > INT_MAX ? INT_MAX : (int)len};
+        fcntl(fd, F_RDADVISE, &ra);
+    }
+#else
+    (void)fd, (void)at, (void)len, (void)drop;
+#endif
+}
+
+// Release the resources held for processing zip->path. The scratch memory is
+// kept for the next zip file. Add the counts for this zip file to the totals.
+// If zip->opt.drop is true, then ask the kernel to drop the zip file's pages
+// from the page cache, once they're no longer mapped, so that a sweep over
+// many zip files doesn't push out the pages that other processes are using.
+static void zip_close(zip_t *zip) {
+    if (zip->in != NULL) {
+        if (zip->map != NULL)
+            munmap(zip->map, zip->size);
+        if (zip->opt.drop)
+            advise(fileno(zip->in), 0, zip->size, 1);
+        fclose(zip->in);
+    }
+    if (zip->opt.copy != NULL && zip->dest != -1)
+        close(zip->dest);
+    if (zip->sum != NULL)
+        tally_add(zip->sum, &zip->count);
+}
+
+// Complete the counts for zip->path, including the calls zip_close() will make,
+// and add them to its report if requested. In JSON mode, end the report with a
+// summary of zip->path, including the error msg if not NULL.
+static void zip_stats(zip_t *zip, char const *msg) {
+    if (zip->in != NULL)
+        zip->count.calls += 1 + (zip->map != NULL) + zip->opt.drop;
+    zip->count.files = 1;
+    zip->count.bytes = zip->size;
+    zip->count.fixed = zip->num;
+    zip->count.errors = msg != NULL && !zip->probe;
+    char line[512];
+    if (zip->opt.json) {
+        if (zip->probe)
+            return;
+        if (zip->opt.stats)
+            tally_line(line, sizeof(line), &zip->count, 1);
+        else
+            snprintf(line, sizeof(line), "\"entries\":%ju,\"fixed\":%ju",
+                     zip->count.entries, zip->count.fixed);
+        say(zip, "{\"file\":");
+        say_str(zip, (unsigned char *)zip->path, strlen(zip->path));
+        say(zip, ",%s,\"modified\":%s,\"error\":", line,
+            zip->mod ? "true" : "false");
+        if (msg == NULL)
+            say(zip, "null}\n");
+        else {
+            // Drop the word, such as " in" or " for", that would precede the
+            // path.
+            static char const *const lead[] = {"in", "on", "of", "at", "as",
+                                               "for", "from"};
+            size_t len = strlen(msg);
+            char const *word = strrchr(msg, ' ');
+            if (word != NULL)
+                for (size_t i = 0; i < sizeof(lead) / sizeof(*lead); i++)
+                    if (strcmp(word + 1, lead[i]) == 0)
+                        len = word - msg;
+            say_str(zip, (unsigned char const *)msg, len);
+            say(zip, "}\n");
+        }
+    }
+    else if (zip->opt.stats) {
+        tally_line(line, sizeof(line), &zip->count, 0);
+        say(zip, "%s: %s\n", zip->path, line);
+    }
+}
+
 // Report an error and give up on zip->path. Release resources.
 static noreturn void throw(zip_t *zip, char *fmt, ...) {
-    fputs("zipclean: ", stderr);
+    char msg[256];
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
     va_end(ap);
-    fprintf(stderr, " %s -- skipping%s\n",
-            zip->path, zip->mod ? " (modified)" : "");
-    free(zip->extra);
-    free(zip->repl);
-    free(zip->name);
-    if (zip->in != NULL)
-        fclose(zip->in);
+    if (zip->fail != NULL) {
+        // This is a part of the central directory -- let zip_split() handle
+        // the error.
+        strcpy(zip->fail, msg);
+        longjmp(zip->env, 1);
+    }
+    if (zip->opt.copy != NULL && zip->dest != -1)
+        unlink(zip->opt.copy);              // don't leave an incomplete copy
+    zip_stats(zip, msg);
+    zip_flush(zip, msg);
+    zip_close(zip);
     longjmp(zip->env, 1);
 }
 
-// Return one byte from zip->in. Throw an error if we can't get one.
-static inline unsigned get1(zip_t *zip) {
-    int ch = getc(zip->in);
-    if (ch == EOF) {
-        if (ferror(zip->in))
-            throw(zip, "read error %s on", strerror(errno));
-        else
-            throw(zip, "premature EOF on");
+// Return a pointer to room for more bytes after the b->len in use. Throw an
+// error if out of memory.
+static unsigned char *grow(zip_t *zip, buf_t *b, size_t more) {
+    if (fits(b, more)) {
+        zip->err = ZIPCLEAN_EMEM;
+        throw(zip, "out of memory");
     }
-    return ch;
+    return b->buf + b->len;
 }
 
-// Return a little-endian unsigned 16-bit integer from zip->in.
-static unsigned get2(zip_t *zip) {
-    unsigned val = get1(zip);
-    return val + (get1(zip) << 8);
+// Return a buffer with room for len bytes for peek() to read into, or NULL if
+// the zip file is mapped, in which case peek() doesn't need one.
+static unsigned char *scratch(zip_t *zip, buf_t *b, size_t len) {
+    if (zip->map != NULL)
+        return NULL;
+    b->len = 0;
+    return grow(zip, b, len);
 }
 
-// Return a little-endian unsigned 32-bit integer from zip->in.
-static uint32_t get4(zip_t *zip) {
-    uint32_t val = get2(zip);
-    return val + ((uint32_t)get2(zip) << 16);
+// Return a little-endian unsigned 16-bit integer from p[0..1].
+static inline unsigned le2(unsigned char const *p) {
+    return p[0] + ((unsigned)p[1] << 8);
 }
 
-// Return a little-endian unsigned 64-bit integer from zip->in.
-static uint64_t get8(zip_t *zip) {
-    uint64_t val = get4(zip);
-    return val + ((uint64_t)get4(zip) << 32);
+// Return a little-endian unsigned 32-bit integer from p[0..3].
+static inline uint32_t le4(unsigned char const *p) {
+    return le2(p) + ((uint32_t)le2(p + 2) << 16);
 }
 
-// Return the current absolute offset in the zip file.
-static off_t tell(zip_t *zip) {
-    off_t at = ftello(zip->in);
-    if (at == -1)
-        throw(zip, "could not tell (%s) on", strerror(errno));
-    return at;
+// Return a little-endian unsigned 64-bit integer from p[0..7].
+static inline uint64_t le8(unsigned char const *p) {
+    return le4(p) + ((uint64_t)le4(p + 4) << 32);
 }
 
-// Move the offset in the zip file by off with base whence. Return the
-// resulting absolute offset in the zip file.
-static off_t seek(zip_t *zip, off_t off, int whence) {
-    int ret = fseeko(zip->in, off, whence);
-    if (ret == -1)
-        throw(zip, "could not seek (%s) on", strerror(errno));
-    return tell(zip);
+// Little-endian stores.
+static inline void set2(unsigned char *p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+static inline void set4(unsigned char *p, uint32_t v) {
+    set2(p, v);
+    set2(p + 2, v >> 16);
+}
+static inline void set8(unsigned char *p, uint64_t v) {
+    set4(p, v);
+    set4(p + 4, v >> 32);
 }
 
-// Return an allocated buffer with len bytes read from the current position.
-static unsigned char *load(zip_t *zip, size_t len) {
-    if (len == 0)
-        return NULL;
-    unsigned char *buf = malloc(len);
-    if (buf == NULL)
-        throw(zip, "out of memory");
-    size_t got = fread(buf, 1, len, zip->in);
-    if (got != len) {
-        free(buf);
+// CRC-32 table for crc32().
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+// Make crc_table[].
+static void crc_make(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+// Return the CRC-32 of buf[0..len-1], continuing from the CRC-32 crc of the
+// preceding bytes, which is zero to start. crc_make() must have been run,
+// once, with crc_once.
+static uint32_t crc32(uint32_t crc, unsigned char const *buf, size_t len) {
+    crc = ~crc;
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[(crc ^ *buf++) & 0xff];
+    return ~crc;
+}
+
+// Give up on zip->path if it's past its time limit.
+static inline void zip_due(zip_t *zip) {
+    if (zip->due != 0 && now() > zip->due)
+        throw(zip, "over time limit on");
+}
+
+// Return a pointer to len bytes at offset at in the zip file. If the zip file
+// is mapped, then this points into the mapping. Otherwise the bytes are read
+// into buf[], which must have room for len bytes, and buf is returned. A
+// remote zip file is read by zip->get(), which does the same, except that buf
+// can be NULL to only fetch the bytes for the peeks that follow. The read and
+// time limits, if any, are checked here.
+static unsigned char const *peek(zip_t *zip, off_t at, size_t len,
+                                 unsigned char *buf) {
+    if (at < 0 || at > zip->size || (uintmax_t)(zip->size - at) < len)
+        throw(zip, "premature EOF on");
+    zip->count.got += len;
+    if (zip->opt.max.bytes && zip->count.got > zip->opt.max.bytes)
+        throw(zip, "over read limit on");
+    zip_due(zip);
+    if (zip->map != NULL)
+        return zip->map + at;
+    if (zip->get != NULL)
+        return zip->get(zip, at, len, buf);
+    zip->count.seeks++;
+    zip->count.reads++;
+    if (fseeko(zip->in, at, SEEK_SET) == -1)
+        throw(zip, "could not seek (%s) on", strerror(errno));
+    if (fread(buf, 1, len, zip->in) != len) {
         if (ferror(zip->in))
             throw(zip, "read error %s on", strerror(errno));
         else
@@ -149,300 +659,3325 @@ static unsigned char *load(zip_t *zip, size_t len) {
     return buf;
 }
 
-// Look for the end of central directory record. Leave the file pointer after
-// its signature. This reads and scans the file backwards for the end record.
-// It will almost always find it in a valid zip file on the first try, once the
-// first four bytes have been processed from the buffer. It will only need to
-// search if there is a zip file comment, which is rare. If the input is not a
-// zip file, this will likely need to read the entire file to find that out.
-// But it's pretty fast.
-static void zip_end(zip_t *zip) {
-    // Set beg and end to the position of the last partial sector. beg will be
-    // a multiple of the sector size, end will be the size of the file, and beg
-    // will be less than end. If the file is empty, then beg will be the
-    // negation of the sector size. Start building the signature back bytes
-    // back from the end in the buffer.
-    unsigned char buf[512];                 // sector-size buffer
-    off_t end = seek(zip, 0, SEEK_END);
-    off_t beg = (end - 1) & (~(off_t)(sizeof(buf) - 1));
-    off_t back = ENDLEN - 3;
-
-    // Read sectors starting at the end of the file, working backwards,
-    // updating the candidate record signature, sig, for each byte.
-    uint32_t sig = 0;
-    while (beg >= 0) {
-        // Read the next sector. The first one may be a partial sector. All
-        // reads start at a multiple of the sector size.
-        seek(zip, beg, SEEK_SET);
-        off_t got = fread(buf, 1, end - beg, zip->in);
-        if (got != end - beg) {
-            if (ferror(zip->in))
-                throw(zip, "read error %s on", strerror(errno));
-            else
-                // Not really sure how this could happen, but just in case.
-                throw(zip, "unexpected EOF on");
-        }
-
-        // Build signatures from buf[] starting back from the end, until an end
-        // of central directory signature is found.
-        for (off_t i = got - back; i >= 0; i--) {
-            sig = (sig << 8) + buf[i];
-            if (sig == END) {
-                // Found it! Set the file pointer to the content of the end
-                // record (after the signature) and return.
-                seek(zip, beg + i + 4, SEEK_SET);
-                return;
-            }
+// Write the n pieces in vec[] to the zip file, contiguously starting at offset
+// at. This is done with as few pwritev() calls as the file system allows. The
+// read-only shared mapping, if any, will reflect the writes. vec[] is modified.
+// A zip file in memory is simply copied to.
+static void put(zip_t *zip, off_t at, struct iovec *vec, int n) {
+    if (zip->in == NULL) {
+        for (int i = 0; i < n; i++) {
+            memcpy(zip->map + at, vec[i].iov_base, vec[i].iov_len);
+            at += vec[i].iov_len;
+        }
+        return;
+    }
+    int fd = zip->opt.copy != NULL ? zip->dest : fileno(zip->in);
+    while (n) {
+        zip->count.writes++;
+        ssize_t writ = pwritev(fd, vec, n, at);
+        if (writ == -1) {
+            if (errno == EINTR)
+                continue;
+            throw(zip, "write error %s on", strerror(errno));
+        }
+        zip->count.put += writ;
+        at += writ;
+        while (n && (size_t)writ >= vec->iov_len) {
+            writ -= vec->iov_len;
+            vec++;
+            n--;
         }
+        if (n) {
+            vec->iov_base = (char *)vec->iov_base + writ;
+            vec->iov_len -= writ;
+        }
+    }
+}
 
-        // Not found in that sector. Get the next sector back.
-        end = beg;
-        beg -= sizeof(buf);
-        if (got < back)
-            back -= got;
-        else
-            back = 1;
+// Return the offset of the last end record signature in buf[] that starts
+// before offset i and at or after offset low, or -1 if there is none. buf[]
+// must have at least three bytes after i. Eight bytes at a time are checked
+// for the final signature byte, so that most of buf[] is skipped over quickly.
+static off_t zip_sig(unsigned char const *buf, size_t low, size_t i) {
+    while (i > low) {
+        if (i - low >= 8) {
+            // See if any of the last signature bytes of the eight candidates
+            // before i are a 6. If not, then skip them all.
+            uint64_t w;
+            memcpy(&w, buf + i - 5, 8);
+            w ^= 0x0606060606060606;
+            if (((w - 0x0101010101010101) & ~w & 0x8080808080808080) == 0) {
+                i -= 8;
+                continue;
+            }
+        }
+        i--;
+        if (le4(buf + i) == END)
+            return i;
     }
+    return -1;
+}
 
-    // Scanned the entire file, but no joy. If we find one by accident in a
-    // non-zip file, then its non-zipness will likely be discovered later.
-    throw(zip, "end of central directory record not found in");
+// Look for the end of central directory record, and return its offset. The
+// record can only be in the last ENDLEN + MAX16 bytes of the file, since the
+// comment that follows it is at most MAX16 bytes long. That window, plus room
+// for a zip64 locator before it, is read all at once, and searched backwards
+// from the end. So no matter how large the file is, or whether or not it is a
+// zip file, no more than that is read. A candidate record whose comment ends
+// at the end of the file is preferred. If there are none, then the one closest
+// to the end is used, permitting junk after the zip file.
+static off_t zip_end(zip_t *zip) {
+    size_t want = ZLOCLEN + ENDLEN + MAX16;
+    off_t beg = zip->size > (off_t)want ? zip->size - (off_t)want : 0;
+    size_t len = zip->size - beg;
+    if (len < ENDLEN)
+        throw(zip, "end of central directory record not found in");
+    unsigned char const *buf = peek(zip, beg, len,
+                                    scratch(zip, &zip->mem->tmp, len));
+    size_t low = len > ENDLEN + MAX16 ? len - ENDLEN - MAX16 : 0;
+    off_t end = -1, i = len - ENDLEN + 1;
+    while ((i = zip_sig(buf, low, i)) != -1) {
+        if (le2(buf + i + ENDLEN - 2) == len - ENDLEN - i) {
+            end = i;
+            break;
+        }
+        if (end == -1)
+            end = i;
+    }
+    if (end == -1)
+        // If we find one by accident in a non-zip file, then its non-zipness
+        // will likely be discovered later.
+        throw(zip, "end of central directory record not found in");
+    return beg + end;
 }
 
-// Move the file pointer to the start of the central directory, and return the
-// number of entries in the directory.
-static uint64_t zip_dir(zip_t *zip) {
+// Find the central directory. Return the number of entries in the directory,
+// and put its offset and length in *off and *len.
+static uint64_t zip_dir(zip_t *zip, off_t *off, size_t *len) {
     // Find the end of central directory record.
-    zip_end(zip);
-
-    // Get the number of entries and the offset of the central directory.
-    seek(zip, 6, SEEK_CUR);
-    uint64_t num = get2(zip);
-    seek(zip, 4, SEEK_CUR);
-    off_t off = get4(zip);
-
-    if (num == MAX16 || off == MAX32) {
-        // Need to get the number and offset from the zip64 end record. Move
-        // back to the zip64 end locator record and get the offset of the zip64
-        // end record.
-        seek(zip, 2 - ENDLEN - ZLOCLEN, SEEK_CUR);
-        if (get4(zip) != ZIP64LOC)
+    double start = now();
+    off_t end = zip->end = zip_end(zip);
+    zip->count.end = now() - start;
+
+    // Get the number of entries, and the length and offset of the central
+    // directory.
+    unsigned char buf[56];
+    unsigned char const *rec = peek(zip, end, ENDLEN - 2, buf);
+    uint64_t num = le2(rec + 10);
+    uint64_t size = le4(rec + 12);
+    *off = le4(rec + 16);
+
+    if (num == MAX16 || size == MAX32 || *off == MAX32) {
+        // Need to get the number and offset from the zip64 end record. Get
+        // the zip64 end locator record just before the end record, and from
+        // that the offset of the zip64 end record.
+        rec = peek(zip, end - ZLOCLEN, ZLOCLEN, buf);
+        if (le4(rec) != ZIP64LOC)
             throw(zip, "missing zip64 locator record in");
-        seek(zip, 4, SEEK_CUR);
-        off = get8(zip);
+        off_t at = le8(rec + 8);
 
-        // Get the number of entries and central directory offset from the
-        // zip64 end record.
-        seek(zip, off, SEEK_SET);
-        if (get4(zip) != ZIP64END)
+        // Get the number of entries, and the central directory length and
+        // offset from the zip64 end record.
+        rec = peek(zip, at, 56, buf);
+        if (le4(rec) != ZIP64END)
             throw(zip, "missing zip64 end record in");
-        seek(zip, 28, SEEK_CUR);
-        num = get8(zip);
-        seek(zip, 8, SEEK_CUR);
-        off = get8(zip);
+        num = le8(rec + 32);
+        size = le8(rec + 40);
+        *off = le8(rec + 48);
     }
 
-    // Point the input to the start of the central directory and return the
-    // number of entries.
-    seek(zip, off, SEEK_SET);
+    // Check that the central directory is in the file before the end record,
+    // and is long enough to hold that many entries, before anything is
+    // allocated for it or scanned. Then check the limit on entries, if any.
+    if (*off < 0 || size > (uint64_t)end || (uint64_t)*off > end - size)
+        throw(zip, "central directory past end of");
+    if (num > size / 46)
+        throw(zip, "too many entries for central directory in");
+    if (zip->opt.max.entries && num > zip->opt.max.entries)
+        throw(zip, "over entry limit in");
+
+    // Return the number of entries, and the length of the central directory,
+    // if it can be held in memory.
+    if (size > SIZE_MAX)
+        throw(zip, "central directory too large in");
+    *len = size;
     return num;
 }
 
-// Fix the name. Return an allocated new name, or NULL if it doesn't need to be
-// fixed.
-static unsigned char *zip_fix(zip_t *zip, size_t nlen) {
-    if (nlen == 0)
+// Return a pointer to the next len bytes of the loaded central directory, and
+// advance past them.
+static unsigned char const *take(zip_t *zip, size_t len) {
+    if (zip->len - zip->pos < len)
+        throw(zip, "truncated central directory in");
+    unsigned char const *p = zip->dir + zip->pos;
+    zip->pos += len;
+    return p;
+}
+
+// Return true if name[0..nlen-1] contains "..". Sixteen pairs at a time are
+// checked with SSE2 if available, otherwise memchr() finds each '.'.
+static int zip_dots(unsigned char const *name, size_t nlen) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128i const dot = _mm_set1_epi8('.');
+    for (; i + 17 <= nlen; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i const *)(name + i));
+        __m128i b = _mm_loadu_si128((__m128i const *)(name + i + 1));
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, dot),
+                                            _mm_cmpeq_epi8(b, dot))))
+            return 1;
+    }
+#endif
+    unsigned char const *end = name + nlen - 1, *p = name + i;
+    while (p < end && (p = memchr(p, '.', end - p)) != NULL) {
+        if (p[1] == '.')
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+// Return a copy of name[0..nlen-1], added to the replacement names.
+static unsigned char *zip_dup(zip_t *zip, unsigned char const *name,
+                              size_t nlen) {
+    buf_t *repl = &zip->mem->repl;
+    unsigned char *dup = grow(zip, repl, nlen);
+    repl->len += nlen;
+    return memcpy(dup, name, nlen);
+}
+
+// Byte classes for zip_fix(). STOP is the end of the name.
+enum { OTHER, SLASH, DOT, COLON, ALPHA, STOP };
+static unsigned char const fix_class[256] = {
+    ['/'] = SLASH, ['\\'] = SLASH, ['.'] = DOT, [':'] = COLON,
+    ['A'] = ALPHA, ['B'] = ALPHA, ['C'] = ALPHA, ['D'] = ALPHA, ['E'] = ALPHA,
+    ['F'] = ALPHA, ['G'] = ALPHA, ['H'] = ALPHA, ['I'] = ALPHA, ['J'] = ALPHA,
+    ['K'] = ALPHA, ['L'] = ALPHA, ['M'] = ALPHA, ['N'] = ALPHA, ['O'] = ALPHA,
+    ['P'] = ALPHA, ['Q'] = ALPHA, ['R'] = ALPHA, ['S'] = ALPHA, ['T'] = ALPHA,
+    ['U'] = ALPHA, ['V'] = ALPHA, ['W'] = ALPHA, ['X'] = ALPHA, ['Y'] = ALPHA,
+    ['Z'] = ALPHA, ['a'] = ALPHA, ['b'] = ALPHA, ['c'] = ALPHA, ['d'] = ALPHA,
+    ['e'] = ALPHA, ['f'] = ALPHA, ['g'] = ALPHA, ['h'] = ALPHA, ['i'] = ALPHA,
+    ['j'] = ALPHA, ['k'] = ALPHA, ['l'] = ALPHA, ['m'] = ALPHA, ['n'] = ALPHA,
+    ['o'] = ALPHA, ['p'] = ALPHA, ['q'] = ALPHA, ['r'] = ALPHA, ['s'] = ALPHA,
+    ['t'] = ALPHA, ['u'] = ALPHA, ['v'] = ALPHA, ['w'] = ALPHA, ['x'] = ALPHA,
+    ['y'] = ALPHA, ['z'] = ALPHA,
+};
+
+// States for zip_fix(), with the fixes to make on entering a state.
+enum { START, DRIVE, PART, DOT1, DOT2, MID };
+#define FIX1 8                      // replace this byte with _
+#define FIX2 16                     // replace the two bytes before with __
+
+// State transitions for zip_fix(), indexed by the current state and the class
+// of the next byte. START is the start of the name, DRIVE is after a letter at
+// the start, PART is the start of a path component, DOT1 and DOT2 are after
+// one and two dots at the start of a component, and MID is anywhere else.
+static unsigned char const fix_next[6][6] = {
+    // OTHER, SLASH, DOT, COLON, ALPHA, STOP
+    {MID, MID | FIX1,  DOT1, MID,        DRIVE, MID},           // START
+    {MID, PART,        MID,  MID | FIX1, MID,   MID},           // DRIVE
+    {MID, PART,        DOT1, MID,        MID,   MID},           // PART
+    {MID, PART,        DOT2, MID,        MID,   MID},           // DOT1
+    {MID, PART | FIX2, MID,  MID,        MID,   MID | FIX2},    // DOT2
+    {MID, PART,        MID,  MID,        MID,   MID}            // MID
+};
+
+// Run name[0..nlen-1] through the automaton in fix_next[], making the fixes
+// in a copy of the name once one is found. Return the copy, or NULL if there
+// were no fixes.
+static unsigned char *zip_classify(zip_t *zip, unsigned char const *name,
+                                   size_t nlen) {
+    unsigned char *fix = NULL;
+    unsigned state = START;
+    for (size_t i = 0; i <= nlen; i++) {
+        state = fix_next[state][i < nlen ? fix_class[name[i]] : STOP];
+        if (state & (FIX1 | FIX2)) {
+            if (fix == NULL)
+                fix = zip_dup(zip, name, nlen);
+            if (state & FIX1)
+                fix[i] = '_';
+            else
+                fix[i - 2] = fix[i - 1] = '_';
+            state &= 7;
+        }
+    }
+    return fix;
+}
+
+// Fix name[0..nlen-1]. Return the new name, added to the replacement names, or
+// NULL if it doesn't need to be fixed. A leading / or \ is replaced by an _,
+// as is the : of a drive letter prefix like C:, and any .. components,
+// delimited by / or \, are replaced with __. Almost no names need fixing, so
+// first quickly rule out the ones that can't.
+static inline unsigned char *zip_fix(zip_t *zip, unsigned char const *name,
+                                     size_t nlen) {
+    if (nlen == 0 || (fix_class[name[0]] != SLASH &&
+                      (nlen < 2 || name[1] != ':') && !zip_dots(name, nlen)))
         return NULL;
-    unsigned char *fix = malloc(nlen);
-    if (fix == NULL)
-        throw(zip, "out of memory");
-    int same = 1;
+    return zip_classify(zip, name, nlen);
+}
 
-    // Replace a leading slash with an underscore.
-    if (zip->name[0] == '/')
-        fix[0] = '_', same = 0;
-    else
-        fix[0] = zip->name[0];
-
-    // Look for .. down references, replace them with __ .
-    int par = fix[0] == '.' ? 2 : 0;    // number of parent characters matched
-    for (size_t i = 1; i < nlen; i++) {
-        unsigned ch = zip->name[i];
-        if (ch == '/')
-            par = 1;
-        else if (par && ch == '.') {
-            par++;
-            if (par == 3) {
-                // Peek ahead to see if the ".." is at the end or followed by
-                // a slash. If so, then this is a down reference. Fix it.
-                if (i == nlen - 1 || zip->name[i + 1] == '/') {
-                    same = 0;
-                    fix[i - 1] = ch = '_';
-                }
-                else
-                    par = 0;
-            }
+// Return a pointer to the Info-ZIP Unicode path extra field data after its
+// version in extra[0..xlen-1], which is the CRC-32 of the header name followed
+// by the UTF-8 name, and put its length in *len. Return NULL if there is none.
+static unsigned char const *zip_upath(unsigned char const *extra, size_t xlen,
+                                      unsigned *len) {
+    size_t i = 0;
+    while (i + 4 <= xlen) {
+        unsigned id = le2(extra + i), size = le2(extra + i + 2);
+        if (i + 4 + size > xlen)
+            break;
+        if (id == UPATH && size >= 5 && extra[i + 4] == 1) {
+            *len = size - 1;
+            return extra + i + 5;
         }
-        else
-            par = 0;
-        fix[i] = ch;
+        i += 4 + size;
     }
+    return NULL;
+}
 
-    // Return the new name if fixed, NULL otherwise.
-    if (same) {
-        free(fix);
-        fix = NULL;
+// Fix the Unicode path at upath[0..len-1], as returned by zip_upath(), for the
+// header name name[0..nlen-1] that is being replaced by fix[0..nlen-1], or not
+// replaced if fix is NULL. Return the new CRC-32 and name, added to the
+// replacement names, or NULL if the Unicode path doesn't need to be fixed. The
+// CRC-32 is updated to that of the fixed header name if it was the CRC-32 of
+// the original header name, so that the fixed Unicode path is used in its
+// place.
+static unsigned char *zip_ufix(zip_t *zip, unsigned char const *upath,
+                               unsigned len, unsigned char const *name,
+                               size_t nlen, unsigned char const *fix) {
+    pthread_once(&crc_once, crc_make);
+    uint32_t crc = le4(upath);
+    if (fix != NULL && crc == crc32(0, name, nlen))
+        crc = crc32(0, fix, nlen);
+    buf_t *repl = &zip->mem->repl;
+    size_t at = repl->len;
+    grow(zip, repl, 4);
+    repl->len += 4;
+    if (zip_fix(zip, upath + 4, len - 4) == NULL) {
+        repl->len = at;
+        return NULL;
     }
-    return fix;
+    set4(repl->buf + at, crc);
+    return repl->buf + at;
 }
 
 // Look for a zip64 extended information extra field in the provided extra
-// data. Return the offset of the local header. skip is 0, 8, or 16, to skip 0,
-// 1, or 2 64-bit lengths in the extra field, which are the compressed and/or
-// uncompressed lengths.
-static off_t zip64_local(zip_t *zip, size_t xlen, size_t skip) {
+// data. Return the 64-bit value after skipping skip bytes in the field. skip is
+// 0, 8, or 16, to skip 0, 1, or 2 64-bit lengths in the extra field, which are
+// the uncompressed and/or compressed lengths. The value found is then the next
+// field, e.g. the offset of the local header.
+static uint64_t zip64_field(zip_t *zip, size_t xlen, size_t skip) {
     size_t i = 0;
     while (i + 3 < xlen) {
-        unsigned id = zip->extra[i] + ((unsigned)zip->extra[i + 1] << 8);
-        unsigned len = zip->extra[i + 2] + ((unsigned)zip->extra[i + 3] << 8);
+        unsigned id = le2(zip->extra + i);
+        unsigned len = le2(zip->extra + i + 2);
         if (id == 1) {
             if (i + 4 + len > xlen || skip + 8 > len)
                 throw(zip, "invalid zip64 info field in");
-            i += 4 + skip;
-            return zip->extra[i] +
-                   ((off_t)zip->extra[i + 1] << 8) +
-                   ((off_t)zip->extra[i + 2] << 16) +
-                   ((off_t)zip->extra[i + 3] << 24) +
-                   ((off_t)zip->extra[i + 4] << 32) +
-                   ((off_t)zip->extra[i + 5] << 40) +
-                   ((off_t)zip->extra[i + 6] << 48) +
-                   ((off_t)zip->extra[i + 7] << 56);
+            return le8(zip->extra + i + 4 + skip);
         }
         i += 4 + len;
     }
     throw(zip, "missing zip64 info field in");
 }
 
-// Process the entry for the central directory header at the file pointer. Fix
-// the file name in the central directory header and in the associated local
-// header, if needed. Leave the file pointer after the end of this header.
+// Add a patch for replacing the len bytes at at in dir[] with the replacement
+// at offset repl in the arena, for the entry with the local header at local.
+// A Unicode path patch also gets the offset of the header name at zip->name.
+static void zip_patch(zip_t *zip, off_t local, unsigned char const *at,
+                      unsigned len, unsigned skip, size_t repl) {
+    buf_t *list = &zip->mem->patch;
+    patch_t *patch = (patch_t *)grow(zip, list, sizeof(patch_t));
+    *patch = (patch_t){local, -1, at - zip->dir, len, skip, repl,
+                       skip ? zip->name - zip->dir : 0};
+    list->len += sizeof(patch_t);
+    zip->num++;
+}
+
+// Process the entry for the central directory header at zip->pos in the loaded
+// central directory. If the file name needs fixing, report it and add the
+// replacement to the patch list, along with the offset of the associated local
+// header. Leave zip->pos after the end of this header.
 static void zip_entry(zip_t *zip) {
     // Check that we're at a central directory header.
-    if (get4(zip) != CENTRAL)
+    zip->last = zip->pos;
+    unsigned char const *head = take(zip, 46);
+    if (le4(head) != CENTRAL)
         throw(zip, "missing central header in");
+    zip->count.entries++;
 
     // Get the name. Also prepare for finding the local header by getting the
     // tentative offset, and checking the compressed and uncompressed sizes to
     // see how much of zip64 extra data would be skipped to get to a long local
     // header offset.
-    seek(zip, 16, SEEK_CUR);
-    size_t skip = 8 * ((get4(zip) == MAX32) + (get4(zip) == MAX32));
-    unsigned nlen = get2(zip);          // file name length
-    unsigned xlen = get2(zip);          // extra field length
-    unsigned clen = get2(zip);          // entry comment length
-    seek(zip, 8, SEEK_CUR);
-    off_t local = get4(zip);            // local entry offset (if not zip64)
-    zip->name = load(zip, nlen);
-    off_t next = tell(zip) + xlen + clen;
-
-    // See if the name needs to be fixed.
-    zip->repl = zip_fix(zip, nlen);
-    if (zip->repl != NULL) {
-        printf("%s: %.*s -> %.*s\n",
-               zip->path, nlen, zip->name, nlen, zip->repl);
-        // Replace the name in the central header.
-        if (zip->fix) {
-            zip->mod = 1;
-            seek(zip, -(off_t)nlen, SEEK_CUR);
-            size_t writ = fwrite(zip->repl, 1, nlen, zip->in);
-            if (writ != nlen)
-                throw(zip, "write error %s on", strerror(errno));
-        }
-
-        // Go to the local header and verify the signature and name.
-        if (local == MAX32) {
-            // Need to get the local header offset from the extra field.
-            zip->extra = load(zip, xlen);
-            local = zip64_local(zip, xlen, skip);
-            free(zip->extra);
-            zip->extra = NULL;
-        }
-        seek(zip, local, SEEK_SET);
-        if (get4(zip) != LOCAL)
+    size_t skip = 8 * ((le4(head + 20) == MAX32) + (le4(head + 24) == MAX32));
+    unsigned nlen = le2(head + 28);     // file name length
+    unsigned xlen = le2(head + 30);     // extra field length
+    unsigned clen = le2(head + 32);     // entry comment length
+    off_t local = le4(head + 42);       // local entry offset (if not zip64)
+    zip->name = take(zip, nlen);
+    zip->extra = take(zip, xlen);
+    take(zip, clen);
+
+    // See if the name needs to be fixed, and the Unicode path if there is
+    // one, while the extra field is at hand.
+    int tell = zip->report == NULL && !zip->opt.quick;
+    unsigned char *repl = zip_fix(zip, zip->name, nlen);
+    if (repl != NULL && tell)
+        say_fix(zip, zip->name, repl, nlen);
+    size_t at = repl == NULL ? 0 : repl - zip->mem->repl.buf;
+    unsigned ulen;
+    unsigned char const *upath = xlen ? zip_upath(zip->extra, xlen, &ulen) :
+                                        NULL;
+    unsigned char *urepl = upath == NULL ? NULL :
+                           zip_ufix(zip, upath, ulen, zip->name, nlen, repl);
+    if (urepl != NULL && tell)
+        say_fix(zip, upath + 4, urepl + 4, ulen - 4);
+    if (repl == NULL && urepl == NULL)
+        return;
+    if (local == MAX32)
+        // Need to get the local header offset from the extra field.
+        local = zip64_field(zip, xlen, skip);
+
+    // Save the replacements for when the local headers are visited.
+    if (repl != NULL)
+        zip_patch(zip, local, zip->name, nlen, 0, at);
+    if (urepl != NULL)
+        zip_patch(zip, local, upath, ulen, 4, urepl - zip->mem->repl.buf);
+}
+
+// Compare the local header offsets of two patches, for qsort(). Patches for
+// the same entry are kept in central directory order.
+static int by_local(void const *a, void const *b) {
+    patch_t const *p = a, *q = b;
+    if (p->local != q->local)
+        return (p->local > q->local) - (p->local < q->local);
+    return (p->name > q->name) - (p->name < q->name);
+}
+
+// Compare the central directory name offsets of two patches, for qsort().
+static int by_name(void const *a, void const *b) {
+    size_t x = ((patch_t const *)a)->name, y = ((patch_t const *)b)->name;
+    return (x > y) - (x < y);
+}
+
+// Write the replacement names to the local headers, or to the central
+// directory if central is true, where the patches are sorted by that offset.
+// Names that are close together are written with a single call, filling in
+// between them with the unchanged bytes, as long as no additional pages are
+// touched that won't be written anyway. Those are in the loaded central
+// directory, or for the local headers, in the mapping if there is one. A zip
+// file in memory has only the names copied.
+static void zip_write(zip_t *zip, int central) {
+    unsigned char const *repl = zip->mem->repl.buf;
+    unsigned char const *fill = zip->in == NULL ? NULL :
+                                central ? zip->dir - zip->beg : zip->map;
+    buf_t *list = &zip->mem->tmp;
+    list->len = 0;
+    struct iovec *vec = (struct iovec *)grow(zip, list,
+                                             IOV_MAX * sizeof(struct iovec));
+    size_t i = 0;
+    while (i < zip->num) {
+        // Gather a run of names that can be written together.
+        off_t at = 0, next = 0;
+        int n = 0;
+        for (; i < zip->num; i++) {
+            patch_t *p = zip->patch + i;
+            off_t to = central ? zip->beg + (off_t)p->name : p->put;
+            if (to == -1)
+                continue;               // Unicode path not in local header
+            if (n) {
+                if (fill == NULL || to < next ||
+                    to / PAGE - (next - 1) / PAGE > 1 || n > IOV_MAX - 2)
+                    break;
+                if (to > next)
+                    vec[n++] = (struct iovec){(void *)(fill + next),
+                                              to - next};
+            }
+            else
+                at = to;
+            vec[n++] = (struct iovec){(void *)(repl + p->repl), p->nlen};
+            next = to + p->nlen;
+        }
+        if (n)
+            put(zip, at, vec, n);
+    }
+}
+
+// Find the run of local headers to be verified starting with list[i], of the
+// num in list[] sorted by offset, where each is less than AHEAD bytes past the
+// end of the one before, spanning no more than RUN bytes. Put the span of the
+// run in *beg..*end-1, and return the index of the entry after the run.
+static size_t zip_run(patch_t const *list, size_t num, size_t i,
+                      off_t *beg, off_t *end) {
+    *beg = list[i].local;
+    *end = *beg + 30 + list[i].nlen;
+    while (++i < num && list[i].local - *end < AHEAD) {
+        off_t next = list[i].local + 30 + list[i].nlen;
+        if (next - *beg > RUN)
+            break;
+        if (*end < next)
+            *end = next;
+    }
+    return i;
+}
+
+// Ask the kernel to start reading all of the local headers to be verified, so
+// that the device can work on them at the same time, instead of one at a time
+// as they are read or faulted in. Nearby headers are joined into one request.
+static void zip_ahead(zip_t *zip) {
+    int fd = fileno(zip->in);
+    size_t i = 0;
+    while (i < zip->num) {
+        off_t beg, end;
+        i = zip_run(zip->patch, zip->num, i, &beg, &end);
+        zip->count.calls++;
+        advise(fd, beg, end - beg, 0);
+    }
+}
+
+// Write all of the zip file to the copy, zip->dest. Return 0 on success, or -1
+// with errno set on failure. The mapping, if any, is written directly.
+static int zip_dup_write(zip_t *zip) {
+    unsigned char *buf = zip->map;
+    size_t size = 1 << 20;
+    if (buf == NULL && (buf = malloc(size)) == NULL)
+        return -1;
+    off_t at = 0;
+    while (at < zip->size) {
+        size_t len = zip->size - at < (off_t)size ? (size_t)(zip->size - at) :
+                                                    size;
+        ssize_t got = len;
+        if (zip->map == NULL) {
+            zip->count.reads++;
+            got = pread(fileno(zip->in), buf, len, at);
+            if (got <= 0) {
+                if (got == -1 && errno == EINTR)
+                    continue;
+                if (got == 0)
+                    errno = EIO;
+                free(buf);
+                return -1;
+            }
+        }
+        zip->count.writes++;
+        ssize_t writ = pwrite(zip->dest, zip->map == NULL ? buf : buf + at,
+                              got, at);
+        if (writ == -1) {
+            if (errno == EINTR)
+                continue;
+            if (zip->map == NULL)
+                free(buf);
+            return -1;
+        }
+        zip->count.put += writ;
+        at += writ;
+    }
+    if (zip->map == NULL)
+        free(buf);
+    return 0;
+}
+
+// Create the copy at zip->opt.copy to write the fixed names to, as zip->dest.
+// The copy is made by cloning the zip file where the file system supports it,
+// in which case the copy shares its data until it's written to. Otherwise it
+// is copied in the kernel with copy_file_range(), or failing that, written
+// out.
+static void zip_clone(zip_t *zip) {
+    zip->count.calls += 2;
+    zip->dest = open(zip->opt.copy, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (zip->dest == -1 || fstat(zip->dest, &st))
+        throw(zip, "could not create %s (%s) for", zip->opt.copy,
+              strerror(errno));
+    if (st.st_dev == zip->st.st_dev && st.st_ino == zip->st.st_ino) {
+        close(zip->dest);
+        zip->dest = -1;                 // don't delete it!
+        throw(zip, "%s is the same file as", zip->opt.copy);
+    }
+    zip->count.calls++;
+    if (ftruncate(zip->dest, 0))
+        throw(zip, "could not truncate %s (%s) for", zip->opt.copy,
+              strerror(errno));
+    int fd = fileno(zip->in);
+#ifdef FICLONE
+    zip->count.calls++;
+    if (ioctl(zip->dest, FICLONE, fd) == 0)
+        return;
+#endif
+#ifdef __linux__
+    off_t in = 0, out = 0;
+    while (in < zip->size) {
+        zip->count.writes++;
+        ssize_t got = copy_file_range(fd, &in, zip->dest, &out,
+                                      zip->size - in, 0);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            if (in == 0)
+                break;                  // not supported -- write it out
+            throw(zip, "could not copy to %s (%s) from", zip->opt.copy,
+                  got ? strerror(errno) : "premature EOF");
+        }
+        zip->count.put += got;
+    }
+    if (in == zip->size)
+        return;
+#endif
+    if (zip_dup_write(zip))
+        throw(zip, "could not copy to %s (%s) from", zip->opt.copy,
+              strerror(errno));
+}
+
+// Make the data written to the file fd durable. Return 0 on success, or -1
+// with errno set on failure. fdatasync() doesn't also wait for metadata like
+// the modification time, where it's available. On macOS, fsync() only gets the
+// data to the drive, and F_FULLFSYNC is needed to get it to the medium, unless
+// the file system doesn't support that.
+static int sync_data(int fd) {
+#if defined(__APPLE__)
+    return fcntl(fd, F_FULLFSYNC) == -1 ? fsync(fd) : 0;
+#elif defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+// Make the writes to the zip file, or the copy if there is one, durable.
+static void zip_sync(zip_t *zip) {
+    zip->count.calls++;
+    if (sync_data(zip->opt.copy != NULL ? zip->dest : fileno(zip->in)))
+        throw(zip, "could not sync (%s) on", strerror(errno));
+}
+
+// Verify the local headers of all of the patched entries, and then replace the
+// names in the central and local headers if requested. The local headers are
+// visited in ascending offset order, so that the reads are a single forward
+// sweep of the file, as are the writes. Nothing is written unless all of the
+// local headers check out. The writes are made durable with one sync_data()
+// before the zip file is reported on. If there is a copy to make, then that is
+// made and written instead of the zip file, even if there are no names to fix.
+static void zip_local(zip_t *zip) {
+    if (zip->num == 0) {
+        if (zip->opt.copy != NULL) {
+            zip_clone(zip);
+            zip_sync(zip);
+        }
+        return;
+    }
+    zip->patch = (patch_t *)zip->mem->patch.buf;
+    qsort(zip->patch, zip->num, sizeof(patch_t), by_local);
+    if (zip->opt.hint && zip->in != NULL)
+        zip_ahead(zip);
+
+    // Verify the signature and name of each local header, and find the Unicode
+    // paths to fix in the local headers. A Unicode path that's there must be
+    // the same as in the central header, as must the name for an entry with
+    // only its Unicode path fixed. For a remote zip file, each run of
+    // nearby headers is fetched with one request.
+    unsigned char *buf = scratch(zip, &zip->mem->tmp, 30 + MAX16);
+    for (size_t i = 0, run = 0; i < zip->num; i++) {
+        if (i == run && zip->get != NULL) {
+            off_t beg, end;
+            run = zip_run(zip->patch, zip->num, i, &beg, &end);
+            peek(zip, beg, end - beg, NULL);
+        }
+        patch_t *p = zip->patch + i;
+        if (p->skip) {
+            unsigned char const *name = zip->dir + p->data;
+            unsigned nlen = le2(name - 18);
+            unsigned char const *loc = peek(zip, p->local, 30 + nlen, buf);
+            if (le4(loc) != LOCAL)
+                throw(zip, "missing local header in");
+            if (le2(loc + 26) != nlen || memcmp(name, loc + 30, nlen))
+                throw(zip, "local/central name mismatch in");
+            off_t at = p->local + 30 + nlen;
+            unsigned xlen = le2(loc + 28), ulen;
+            unsigned char const *extra = peek(zip, at, xlen, buf);
+            unsigned char const *upath = zip_upath(extra, xlen, &ulen);
+            if (upath == NULL)
+                continue;
+            if (ulen != p->nlen || memcmp(zip->dir + p->name, upath, ulen))
+                throw(zip, "local/central Unicode path mismatch in");
+            p->put = at + (upath - extra);
+            continue;
+        }
+        unsigned char const *loc = peek(zip, p->local, 30 + p->nlen, buf);
+        if (le4(loc) != LOCAL)
             throw(zip, "missing local header in");
-        seek(zip, 22, SEEK_CUR);
-        if (get2(zip) != nlen)
-            throw(zip, "local/central name mismatch in");
-        seek(zip, 2, SEEK_CUR);
-        unsigned char *name = load(zip, nlen);
-        int diff = memcmp(zip->name, name, nlen);
-        free(name);
-        if (diff)
+        if (le2(loc + 26) != p->nlen ||
+            memcmp(zip->dir + p->name, loc + 30, p->nlen))
             throw(zip, "local/central name mismatch in");
+        p->put = p->local + 30;
+    }
 
-        // Replace the name in the local header.
-        if (zip->fix) {
-            seek(zip, -(off_t)nlen, SEEK_CUR);
-            size_t writ = fwrite(zip->repl, 1, nlen, zip->in);
-            if (writ != nlen)
-                throw(zip, "write error %s on", strerror(errno));
+    // Replace the names in the local headers, and then in the central
+    // directory, which follows them. Report the names to a zipclean_buffer()
+    // caller in between, while the original names are still in dir[].
+    if (zip->opt.fix) {
+        if (zip->opt.copy != NULL)
+            zip_clone(zip);
+        else {
+            if (zip->keep != NULL)
+                zip->keep(zip);
+            zip->mod = 1;
+        }
+        zip_write(zip, 0);
+    }
+    if (zip->opt.fix || zip->report != NULL)
+        qsort(zip->patch, zip->num, sizeof(patch_t), by_name);
+    if (zip->report != NULL)
+        for (size_t i = 0; i < zip->num; i++) {
+            patch_t *p = zip->patch + i;
+            zip->report(zip->opaque, zip->dir + p->name + p->skip,
+                        zip->mem->repl.buf + p->repl + p->skip,
+                        p->nlen - p->skip);
         }
-        free(zip->repl);
-        zip->repl = NULL;
+    if (zip->opt.fix) {
+        zip_write(zip, 1);
+        if (zip->in != NULL)
+            zip_sync(zip);
     }
-    free(zip->name);
-    zip->name = NULL;
-    seek(zip, next, SEEK_SET);
 }
 
-// Clean the zip file path. If fix is zero, then report changes that would be
-// made, but don't make them.
-static void zip_clean(char *path, int fix) {
-    // Open the zip file.
-    zip_t zip_s = {0}, *zip = &zip_s;
-    zip->path = path;
-    zip->in = fopen(path, fix ? "r+b" : "rb");
-    zip->fix = fix;
-    zip->mod = 0;
-    if (setjmp(zip->env))               // prepare for throw()
-        return;
-    if (zip->in == NULL)
-        throw(zip, "failed to open%s", fix ? " (for writing)" : "");
+// Do-nothing report for zipclean_buffer().
+static void zip_ignore(void *opaque, unsigned char const *name,
+                       unsigned char const *repl, size_t len) {
+    (void)opaque, (void)name, (void)repl, (void)len;
+}
 
-    // Find the central directory and then fix the name of each entry as
-    // needed and requested.
-    uint64_t n = zip_dir(zip);
+// Clean the zip file in data[0..len-1], per zipclean.h. The zip file is
+// processed as if it were mapped, except that it is written to directly, and
+// nothing is written to stdout or stderr. throw() returns here.
+int zipclean_buffer(void *data, size_t len, int flags,
+                    zipclean_report_t *report, void *opaque) {
+    arena_t mem = {0};
+    zip_t zip_s = {0}, *zip = &zip_s;
+    zip->path = "(buffer)";
+    zip->mem = &mem;
+    zip->map = data;
+    zip->size = len;
+    if (zip->size < 0 || (size_t)zip->size != len)
+        return ZIPCLEAN_EZIP;
+    zip->opt.fix = flags & ZIPCLEAN_FIX;
+    zip->probe = 1;                     // never complain on stderr
+    zip->err = ZIPCLEAN_EZIP;
+    zip->report = report == NULL ? zip_ignore : report;
+    zip->opaque = opaque;
+    if (setjmp(zip->env)) {             // prepare for throw()
+        arena_free(&mem);
+        return zip->err;
+    }
+    uint64_t n = zip_dir(zip, &zip->beg, &zip->len);
+    zip->dir = peek(zip, zip->beg, zip->len, NULL);
     while (n) {
         zip_entry(zip);
         n--;
     }
-    fclose(zip->in);
+    zip_local(zip);
+    int num = zip->num > INT_MAX ? INT_MAX : (int)zip->num;
+    arena_free(&mem);
+    return num;
 }
 
-// Process all of the zip files on the command line, fixing them if the -f
-// option is given. By default, the files are untouched, and changes that would
-// be made are only reported. If the -- option is given, subsequent file names
-// can start with a dash, and won't be treated as invalid options.
-int main(int argc, char **argv) {
-    // Process options.
-    int fix = 0, opt = INT_MAX;
-    for (int i = 1; i < argc; i++)
-        if (argv[i][0] == '-') {
-            if (strcmp(argv[i] + 1, "f") == 0)
-                fix = 1;
-            else if (strcmp(argv[i] + 1, "-") == 0) {
-                opt = i;
-                break;
-            }
-            else {
-                fprintf(stderr, "unknown option %s\n", argv[i]);
-                return 1;
-            }
+// Return a description of the zipclean_buffer() return value err.
+char const *zipclean_error(int err) {
+    return err >= 0 ? "ok" :
+           err == ZIPCLEAN_EZIP ? "invalid zip file" :
+           err == ZIPCLEAN_EMEM ? "out of memory" : "unknown error";
+}
+
+#ifndef ZIPCLEAN_LIB
+
+// Map the zip file into memory if it is a regular file that can be mapped,
+// unless zip->opt.stdio is true. Otherwise leave zip->map as NULL, in which
+// case stdio is used to read the zip file. Either way, set zip->size to the
+// length of the file.
+static void zip_map(zip_t *zip) {
+    struct stat st;
+    int fd = fileno(zip->in);
+    zip->count.calls++;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        zip->st = st;
+        zip->size = st.st_size;
+        if (!zip->opt.stdio && zip->size > 0 &&
+            (uintmax_t)zip->size <= SIZE_MAX) {
+            zip->count.calls++;
+            void *map = mmap(NULL, zip->size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED)
+                zip->map = map;
         }
+        return;
+    }
+    zip->count.seeks++;
+    if (fseeko(zip->in, 0, SEEK_END) == -1 ||
+        (zip->size = ftello(zip->in)) == -1)
+        throw(zip, "could not seek (%s) on", strerror(errno));
+}
 
-    // Process files.
-    for (int i = 1; i < argc; i++)
-        if (argv[i][0] != '-' || i > opt)
-            zip_clean(argv[i], fix);
-    return 0;
+// Return a hash of name[0..len-1], taking \ to be the same as /.
+static uint64_t name_hash(unsigned char const *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325;        // FNV-1a
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (name[i] == '\\' ? '/' : name[i])) * 0x100000001b3;
+    return h;
+}
+
+// Return true if a[0..len-1] and b[0..len-1] are the same name, taking \ to be
+// the same as /.
+static int name_same(unsigned char const *a, unsigned char const *b,
+                     size_t len) {
+    for (size_t i = 0; i < len; i++)
+        if (a[i] != b[i] && (a[i] == '\\' ? '/' : a[i]) !=
+                            (b[i] == '\\' ? '/' : b[i]))
+            return 0;
+    return 1;
+}
+
+// A slot in the --collisions hash set is zero if empty. Otherwise the low SEEN
+// bits are one more than the offset of the name in dir[], or if the FIXED bit
+// is set, one more than the index of its patch. The UNI bit is set for a
+// Unicode path in dir[] that isn't fixed. The bits above UNI are the high bits
+// of the name's hash, so most probes don't need to look at names.
+#define SEEN 40
+#define FIXED ((uint64_t)1 << SEEN)
+#define UNI ((uint64_t)1 << (SEEN + 1))
+#define TAG (SEEN + 2)
+
+// Report that repl[0..len-1], which name[0..len-1] is fixed to, is the same as
+// the final name of another entry.
+static void say_collide(zip_t *zip, unsigned char const *name,
+                        unsigned char const *repl, size_t len) {
+    if (zip->opt.json) {
+        say(zip, "{\"file\":");
+        say_str(zip, (unsigned char *)zip->path, strlen(zip->path));
+        say(zip, ",\"name\":");
+        say_str(zip, name, len);
+        say(zip, ",\"collides\":");
+        say_str(zip, repl, len);
+        say(zip, "}\n");
+    }
+    else
+        say(zip, "%s: %.*s -> %.*s collides with another entry\n",
+            zip->path, (int)len, name, (int)len, repl);
+}
+
+// Return the name for the --collisions slot value s, without the hash bits,
+// and put its length in *len. A fixed Unicode path is after its CRC-32 in the
+// replacement, and an unfixed one has its length in its extra field header.
+static unsigned char const *seen_name(zip_t const *zip, uint64_t s,
+                                      size_t *len) {
+    size_t v = (s & (FIXED - 1)) - 1;
+    if (s & FIXED) {
+        patch_t const *p = (patch_t const *)zip->mem->patch.buf + v;
+        *len = p->nlen - p->skip;
+        return zip->mem->repl.buf + p->repl + p->skip;
+    }
+    *len = s & UNI ? le2(zip->dir + v - 7) - 5u : le2(zip->dir + v - 18);
+    return zip->dir + v;
+}
+
+// Add the name for the slot value val to the --collisions hash set slot[],
+// with mask one less than its size, if the same name isn't already there. If
+// it is, and at least one of the two was fixed, then report the fixed one and
+// return true. Otherwise return false.
+static int seen_add(zip_t *zip, uint64_t *slot, size_t mask, uint64_t val) {
+    size_t len;
+    unsigned char const *str = seen_name(zip, val, &len);
+    uint64_t h = name_hash(str, len), tag = h >> TAG << TAG;
+    size_t i = h & mask;
+    for (; slot[i]; i = (i + 1) & mask) {
+        if ((slot[i] ^ tag) >> TAG)
+            continue;
+        size_t was;
+        unsigned char const *name = seen_name(zip, slot[i], &was);
+        if (was == len && name_same(str, name, len))
+            break;
+    }
+    if (slot[i] == 0) {
+        slot[i] = tag | val;
+        return 0;
+    }
+    if (((slot[i] | val) & FIXED) == 0)
+        return 0;
+    patch_t const *p = (patch_t const *)zip->mem->patch.buf +
+                       (((val & FIXED ? val : slot[i]) & (FIXED - 1)) - 1);
+    say_collide(zip, zip->dir + p->name + p->skip,
+                zip->mem->repl.buf + p->repl + p->skip, p->nlen - p->skip);
+    return 1;
+}
+
+// Check that the final names of all n entries of the central directory, after
+// fixing, don't collide where at least one was fixed, as when ../a is fixed to
+// __/a and there is already a __/a. Otherwise one would overwrite the other
+// when extracted. The final names include the Unicode paths, fixed or not,
+// where they differ from the header names. Each collision is reported, and
+// then the zip file is given up on, before anything is written. The names are
+// put in an open-addressing hash set with room for twice as many as two per
+// entry, holding the offsets of the names in dir[], or for fixed names the
+// indices of their patches, so that the names aren't copied, and it takes
+// linear time. The patches have to still be in central directory order.
+static void zip_collide(zip_t *zip, uint64_t n) {
+    if (zip->len >= FIXED - 1)
+        throw(zip, "central directory too large to check for collisions in");
+    size_t size = 64;
+    while (size < 4 * n)
+        size <<= 1;
+    buf_t *set = &zip->mem->seen;
+    set->len = 0;
+    uint64_t *slot = (uint64_t *)grow(zip, set, size * sizeof(uint64_t));
+    memset(slot, 0, size * sizeof(uint64_t));
+    patch_t const *patch = (patch_t const *)zip->mem->patch.buf;
+    size_t k = 0;
+    int bad = 0;
+    zip->pos = 0;
+    for (; n; n--) {
+        unsigned char const *head = take(zip, 46);
+        unsigned xlen = le2(head + 30);
+        unsigned char const *name = take(zip, le2(head + 28));
+        unsigned char const *extra = take(zip, xlen);
+        take(zip, le2(head + 32));
+
+        // Add the final name, fixed or not.
+        size_t at = name - zip->dir;
+        while (k < zip->num && patch[k].name < at)
+            k++;
+        uint64_t val = k < zip->num && patch[k].name == at ? FIXED | (k + 1) :
+                                                             at + 1;
+        bad |= seen_add(zip, slot, size - 1, val);
+
+        // Add the final Unicode path, if there is one and it's different. Its
+        // patch, if any, is at the start of the field data, before the CRC-32.
+        unsigned ulen;
+        unsigned char const *upath = xlen ? zip_upath(extra, xlen, &ulen) :
+                                            NULL;
+        if (upath == NULL)
+            continue;
+        at = upath - zip->dir;
+        while (k < zip->num && patch[k].name < at)
+            k++;
+        uint64_t uval = k < zip->num && patch[k].name == at ?
+                        FIXED | (k + 1) : UNI | (at + 4 + 1);
+        size_t len, was;
+        unsigned char const *str = seen_name(zip, val, &len),
+                            *ustr = seen_name(zip, uval, &was);
+        if (was != len || !name_same(str, ustr, len))
+            bad |= seen_add(zip, slot, size - 1, uval);
+    }
+    if (bad)
+        throw(zip, "fixed names collide in");
 }
+
+// Check the n entries of the central directory scanned starting at first in
+// dir[], after old entries that were not scanned. The local header offsets are
+// listed and sorted, along with the least offset after each entry's data,
+// using the name length and compressed size in the central header. If
+// zip->opt.overlap is true, then all of the entries are checked for sharing or
+// overlapping each other's local headers and data, or running into the central
+// directory, as done to make zip bombs by quoting one entry's data in another.
+// That takes one pass over the sorted list, since an overlap with any later
+// entry is also an overlap with the next one. The old entries before first are
+// included, so that new entries can't quote their data.
+//
+// If zip->opt.verify is true, then the local headers of the entries scanned
+// are checked for a local header signature and the same name as the central
+// header. The local headers are visited in ascending offset order, as one
+// forward sweep of the file. The kernel is asked to start reading the headers
+// up to RUN bytes ahead of the one being checked, joining nearby ones as for
+// zip_ahead(), so that the sweep streams without reading the entry data in
+// between. For a remote zip file, each run of nearby headers is fetched with
+// one request.
+static void zip_check(zip_t *zip, size_t first, uint64_t old, uint64_t n) {
+    // List the local headers from the central directory, which has already
+    // been scanned, and sort them by offset. The old entries are only needed
+    // for checking overlaps.
+    buf_t *list = &zip->mem->check;
+    list->len = 0;
+    zip->pos = zip->opt.overlap ? 0 : first;
+    for (n += zip->opt.overlap ? old : 0; n; n--) {
+        unsigned char const *head = take(zip, 46);
+        uint64_t clen = le4(head + 20);
+        size_t skip = 8 * ((clen == MAX32) + (le4(head + 24) == MAX32));
+        unsigned nlen = le2(head + 28), xlen = le2(head + 30);
+        off_t local = le4(head + 42);
+        zip->name = take(zip, nlen);
+        zip->extra = take(zip, xlen);
+        take(zip, le2(head + 32));
+        if (local == MAX32)
+            local = zip64_field(zip, xlen, skip);
+        if (clen == MAX32)
+            clen = zip64_field(zip, xlen, 8 * (le4(head + 24) == MAX32));
+        if (local < 0 || local > zip->beg)
+            throw(zip, "local header past central directory in");
+        patch_t *p = (patch_t *)grow(zip, list, sizeof(patch_t));
+        *p = (patch_t){local, -1, zip->name - zip->dir, nlen, 0, 0,
+                       local + 30 + nlen + (clen > (uint64_t)zip->size ?
+                                            zip->size : (off_t)clen)};
+        list->len += sizeof(patch_t);
+    }
+    patch_t *check = (patch_t *)list->buf;
+    size_t num = list->len / sizeof(patch_t);
+    qsort(check, num, sizeof(patch_t), by_local);
+
+    // Look for overlaps.
+    if (zip->opt.overlap && num) {
+        for (size_t i = 1; i < num; i++)
+            if (check[i].local < check[i - 1].data)
+                throw(zip, "overlapping entries in");
+        if (check[num - 1].data > zip->beg)
+            throw(zip, "entry data runs into central directory in");
+    }
+    if (!zip->opt.verify)
+        return;
+
+    // Sweep the local headers of the entries scanned.
+    size_t keep = 0;
+    for (size_t i = 0; i < num; i++)
+        if (check[i].name >= first)
+            check[keep++] = check[i];
+    num = keep;
+    int fd = zip->in == NULL ? -1 : fileno(zip->in);
+    unsigned char *buf = scratch(zip, &zip->mem->tmp, 30 + MAX16);
+    off_t beg, end;
+    for (size_t i = 0, run = 0, ahead = 0; i < num; i++) {
+        patch_t *p = check + i;
+        if (i == run && zip->get != NULL) {
+            run = zip_run(check, num, i, &beg, &end);
+            peek(zip, beg, end - beg, NULL);
+        }
+        while (fd != -1 && ahead < num &&
+               check[ahead].local - p->local < RUN) {
+            ahead = zip_run(check, num, ahead, &beg, &end);
+            zip->count.calls++;
+            advise(fd, beg, end - beg, 0);
+        }
+        unsigned char const *loc = peek(zip, p->local, 30 + p->nlen, buf);
+        if (le4(loc) != LOCAL)
+            throw(zip, "missing local header in");
+        if (le2(loc + 26) != p->nlen ||
+            memcmp(zip->dir + p->name, loc + 30, p->nlen))
+            throw(zip, "local/central name mismatch in");
+    }
+}
+
+// Load the central directory into mem->dir with O_DIRECT reads, bypassing the
+// page cache, and return a pointer to it. The read is widened to DIRECT
+// boundaries, and made into a buffer aligned to match. Return NULL if O_DIRECT
+// isn't available for the zip file, in which case peek() is to be used.
+static unsigned char const *zip_direct(zip_t *zip) {
+#ifdef O_DIRECT
+    if (zip->in == NULL || zip->get != NULL || zip->len == 0 ||
+        !S_ISREG(zip->st.st_mode))
+        return NULL;
+    if (zip->beg < 0 || zip->beg > zip->size ||
+        (uintmax_t)(zip->size - zip->beg) < zip->len)
+        throw(zip, "premature EOF on");
+    off_t from = zip->beg & ~(off_t)(DIRECT - 1);
+    size_t skip = zip->beg - from, want = skip + zip->len;
+    size_t span = (want + DIRECT - 1) & ~(size_t)(DIRECT - 1);
+    buf_t *b = &zip->mem->dir;
+    b->len = 0;
+    unsigned char *buf = grow(zip, b, span + DIRECT);
+    buf += (DIRECT - (uintptr_t)buf % DIRECT) % DIRECT;
+    int fd = fileno(zip->in), flags = fcntl(fd, F_GETFL);
+    zip->count.calls += 2;
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_DIRECT) == -1)
+        return NULL;
+    size_t got = 0;
+    int err = 0;
+    while (got < want) {
+        zip->count.reads++;
+        ssize_t n = pread(fd, buf + got, span - got, from + got);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            err = n == 0 ? -1 : errno;
+            break;
+        }
+        got += n;
+    }
+    zip->count.calls++;
+    fcntl(fd, F_SETFL, flags);
+    if (err == EINVAL && got == 0)
+        return NULL;                    // O_DIRECT not supported here
+    if (err == -1)
+        throw(zip, "premature EOF on");
+    if (err)
+        throw(zip, "read error %s on", strerror(err));
+    zip->count.got += zip->len;
+    if (zip->opt.max.bytes && zip->count.got > zip->opt.max.bytes)
+        throw(zip, "over read limit on");
+    return buf + skip;
+#else
+    (void)zip;
+    return NULL;
+#endif
+}
+
+// Record of a zip file found to be clean, as saved in the cache file.
+typedef struct {
+    uint64_t dev;           // device of the file
+    uint64_t ino;           // inode of the file
+    uint64_t size;          // length of the file
+    uint64_t mtime;         // modification time of the file in nanoseconds
+    uint64_t end;           // offset of the end record in the file
+    uint64_t beg;           // offset of the central directory in the file
+    uint64_t len;           // length of the central directory
+    uint64_t num;           // number of entries in the central directory
+    uint64_t last;          // offset of the last header in the directory
+    uint64_t local;         // local header offset of that last entry
+    uint64_t checks;        // CHECK_ bits for the checks that were passed
+} clean_t;
+
+// Checks done on a zip file beyond the names, which a clean_t record must have
+// been passed for it to be skipped.
+#define CHECK_VERIFY 1      // --verify
+#define CHECK_OVERLAP 2     // --overlap
+#define CHECK_COLLIDE 4     // --collisions
+
+// Cache of clean zip files, loaded from an append-only log of clean_t records,
+// and appended to as more clean zip files are found. The most recent record for
+// a file is the one used.
+typedef struct cache_s {
+    char *path;             // path of the cache file
+    int fd;                 // cache file open for appending, or -1 if failed
+    clean_t *rec;           // records loaded from the cache file
+    size_t num;             // number of records in rec[]
+    size_t *hash;           // indices of records in rec[] plus one, or zero
+    size_t mask;            // one less than the size of hash[], a power of two
+    int grow;               // true to only scan entries added since the record
+    pthread_mutex_t lock;   // lock for appending
+} cache_t;
+
+// Cache file identification, at its start.
+#define CACHE "zipclean cache 5\n\0\0\0\0\0\0\0"
+#define CACHELEN 24
+
+// Return the modification time in st, in nanoseconds.
+static uint64_t mtime(struct stat const *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_sec * 1000000000ULL + st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Return the CHECK_ bits for the checks requested in opt.
+static uint64_t cache_checks(opts_t const *opt) {
+    return (opt->verify ? CHECK_VERIFY : 0) |
+           (opt->overlap ? CHECK_OVERLAP : 0) |
+           (opt->collide ? CHECK_COLLIDE : 0);
+}
+
+// Return the slot in cache->hash[] for the device and inode in st, which has
+// either the index of the record for that file plus one, or zero if none.
+static size_t *cache_slot(cache_t *cache, struct stat const *st) {
+    uint64_t h = ((uint64_t)st->st_dev * 0x9e3779b97f4a7c15) ^ st->st_ino;
+    h *= 0xff51afd7ed558ccd;
+    size_t i = (h ^ (h >> 32)) & cache->mask;
+    for (;;) {
+        size_t k = cache->hash[i];
+        if (k == 0 || (cache->rec[k - 1].dev == (uint64_t)st->st_dev &&
+                       cache->rec[k - 1].ino == (uint64_t)st->st_ino))
+            return cache->hash + i;
+        i = (i + 1) & cache->mask;
+    }
+}
+
+// Load the cache file at path, creating it if it doesn't exist, and open it
+// for appending. Return NULL, after saying why, on failure.
+static cache_t *cache_open(char *path) {
+    cache_t *cache = calloc(1, sizeof(cache_t));
+    if (cache == NULL) {
+        fputs("zipclean: out of memory\n", stderr);
+        return NULL;
+    }
+    cache->path = path;
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+    struct stat st;
+    if (cache->fd == -1 || fstat(cache->fd, &st)) {
+        fprintf(stderr, "zipclean: could not open cache %s (%s)\n",
+                path, strerror(errno));
+        free(cache);
+        return NULL;
+    }
+
+    // Read the records. A partial record at the end is ignored. A cache from
+    // another version of zipclean is started over.
+    unsigned char head[CACHELEN] = {0};
+    if (st.st_size != 0 &&
+        (pread(cache->fd, head, CACHELEN, 0) != CACHELEN ||
+         memcmp(head, CACHE, CACHELEN))) {
+        if (memcmp(head, CACHE, 15) || ftruncate(cache->fd, 0)) {
+            fprintf(stderr, "zipclean: %s is not a zipclean cache\n", path);
+            close(cache->fd);
+            free(cache);
+            return NULL;
+        }
+        st.st_size = 0;
+    }
+    if (st.st_size == 0) {
+        if (write(cache->fd, CACHE, CACHELEN) != CACHELEN) {
+            fprintf(stderr, "zipclean: could not write cache %s\n", path);
+            close(cache->fd);
+            free(cache);
+            return NULL;
+        }
+    }
+    else {
+        size_t num = (st.st_size - CACHELEN) / sizeof(clean_t);
+        cache->rec = malloc(num * sizeof(clean_t) + 1);
+        if (cache->rec != NULL &&
+            pread(cache->fd, cache->rec, num * sizeof(clean_t), CACHELEN) ==
+                (ssize_t)(num * sizeof(clean_t)))
+            cache->num = num;
+    }
+
+    // Index the records by device and inode, with later records for a file
+    // replacing earlier ones.
+    size_t size = 1;
+    while (size < 2 * cache->num + 1)
+        size <<= 1;
+    cache->hash = calloc(size, sizeof(size_t));
+    if (cache->hash == NULL) {
+        cache->num = 0;
+        size = 1;
+        cache->hash = calloc(size, sizeof(size_t));
+    }
+    cache->mask = size - 1;
+    for (size_t i = 0; i < cache->num; i++) {
+        clean_t *r = cache->rec + i;
+        struct stat id;
+        id.st_dev = r->dev;
+        id.st_ino = r->ino;
+        *cache_slot(cache, &id) = i + 1;
+    }
+    return cache;
+}
+
+// Append the records in save to the cache file.
+static void cache_write(cache_t *cache, buf_t *save) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->fd != -1 && save->len &&
+        write(cache->fd, save->buf, save->len) != (ssize_t)save->len) {
+        fprintf(stderr, "zipclean: could not write cache %s\n", cache->path);
+        close(cache->fd);
+        cache->fd = -1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    save->len = 0;
+}
+
+// Close the cache file and release the cache.
+static void cache_close(cache_t *cache) {
+    if (cache->fd != -1)
+        close(cache->fd);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->hash);
+    free(cache->rec);
+    free(cache);
+}
+
+// Return the local header offset of the entry with the central header at pos
+// in the loaded central directory, and put the offset after the header in
+// *end. Return -1 if the header is not complete or the offset can't be found.
+// This does not throw, so that a header that was never needed for a fix can't
+// fail a zip file that is otherwise clean.
+static off_t cache_local(zip_t const *zip, size_t pos, size_t *end) {
+    if (pos > zip->len || zip->len - pos < 46)
+        return -1;
+    unsigned char const *head = zip->dir + pos;
+    size_t nlen = le2(head + 28), xlen = le2(head + 30);
+    *end = pos + 46 + nlen + xlen + le2(head + 32);
+    if (*end > zip->len || le4(head) != CENTRAL)
+        return -1;
+    if (le4(head + 42) != MAX32)
+        return le4(head + 42);
+    size_t skip = 8 * ((le4(head + 20) == MAX32) + (le4(head + 24) == MAX32));
+    unsigned char const *x = head + 46 + nlen;
+    for (size_t i = 0; i + 3 < xlen; i += 4 + le2(x + i + 2))
+        if (le2(x + i) == 1)
+            return i + 4 + le2(x + i + 2) > xlen ||
+                   skip + 8 > le2(x + i + 2) ? -1 :
+                   (off_t)le8(x + i + 4 + skip);
+    return -1;
+}
+
+// Add a record for the clean zip file to job->save, with the number of entries
+// n in its central directory, and the checks it passed. The last header
+// scanned is recorded for --incremental, which looks for it in the same place
+// the next time. Append the records to the cache file once there are enough of
+// them.
+static void cache_save(job_t *job, zip_t *zip, uint64_t n) {
+    buf_t *save = &job->save;
+    if (fits(save, sizeof(clean_t)))
+        return;
+    size_t end;
+    clean_t *r = (clean_t *)(save->buf + save->len);
+    *r = (clean_t){zip->st.st_dev, zip->st.st_ino, zip->st.st_size,
+                   mtime(&zip->st), zip->end, zip->beg, zip->len, n, zip->last,
+                   n ? (uint64_t)cache_local(zip, zip->last, &end) :
+                       (uint64_t)-1, cache_checks(&zip->opt)};
+    save->len += sizeof(clean_t);
+    if (save->len >= 128 * sizeof(clean_t))
+        cache_write(job->cache, save);
+}
+
+// Undo journal, appended to by all of the threads. A journal record for a zip
+// file has the names to be replaced and where they are, so that the zip file
+// can be restored with --undo. A record is, with little-endian integers:
+//
+//      4   JOURNAL signature
+//      4   length of the record
+//      8   device of the zip file
+//      8   inode of the zip file
+//      8   length of the zip file
+//      4   number of names (n)
+//      2   length of the path (len)
+//    len   path of the zip file
+//      n   names, each:
+//          8   offset of the name in the local header, or all ones if none
+//          8   offset of the name in the central directory
+//          2   length of the name (nlen)
+//          1   bytes before the name (4 for a Unicode path CRC-32, else 0)
+//       nlen   original name
+//       nlen   replacement name
+//      4   CRC-32 of the above
+//
+// The journal is synced after each record is appended, before the names are
+// replaced. A record cut short by a crash is discarded when undoing.
+#define JOURNAL 0x4b435a50      // "PZCK"
+static struct {
+    char *path;             // path of the journal
+    int fd;                 // journal open for appending
+    pthread_mutex_t lock;   // lock for appending
+} journal = {NULL, -1, PTHREAD_MUTEX_INITIALIZER};
+
+// Append the names about to be replaced in zip->path to the journal, and sync
+// it. This is zip->keep, called after the local headers have been verified,
+// when zip->patch[] is sorted by local offset.
+static void zip_keep(zip_t *zip) {
+    size_t plen = strlen(zip->path);
+    if (plen > MAX16)
+        throw(zip, "path too long for journal for");
+    size_t len = 4 + 4 + 8 + 8 + 8 + 4 + 2 + plen + 4;
+    for (size_t i = 0; i < zip->num; i++)
+        len += 19 + 2 * zip->patch[i].nlen;
+    if (len > MAX32)
+        throw(zip, "too many names for journal for");
+    buf_t *tmp = &zip->mem->tmp;
+    tmp->len = 0;
+    unsigned char *rec = grow(zip, tmp, len), *p = rec;
+    set4(p, JOURNAL);
+    set4(p + 4, len);
+    set8(p + 8, zip->st.st_dev);
+    set8(p + 16, zip->st.st_ino);
+    set8(p + 24, zip->size);
+    set4(p + 32, zip->num);
+    set2(p + 36, plen);
+    memcpy(p + 38, zip->path, plen);
+    p += 38 + plen;
+    for (size_t i = 0; i < zip->num; i++) {
+        patch_t *at = zip->patch + i;
+        set8(p, at->put);
+        set8(p + 8, zip->beg + at->name);
+        set2(p + 16, at->nlen);
+        p[18] = at->skip;
+        memcpy(p + 19, zip->dir + at->name, at->nlen);
+        memcpy(p + 19 + at->nlen, zip->mem->repl.buf + at->repl, at->nlen);
+        p += 19 + 2 * at->nlen;
+    }
+    set4(p, crc32(0, rec, p - rec));
+
+    // Append the record and sync the journal.
+    pthread_mutex_lock(&journal.lock);
+    zip->count.calls += 2;
+    int bad = write(journal.fd, rec, len) != (ssize_t)len ||
+              sync_data(journal.fd);
+    pthread_mutex_unlock(&journal.lock);
+    if (bad)
+        throw(zip, "could not write journal %s for", journal.path);
+}
+
+// Restore the names in the zip file for the journal record at rec. The zip
+// file must still be the same file, with the same length, and each name must
+// be either the original or its replacement. Report the restored names.
+static void zip_undo(unsigned char const *rec, arena_t *mem) {
+    size_t plen = le2(rec + 36);
+    char path[plen + 1];
+    memcpy(path, rec + 38, plen);
+    path[plen] = 0;
+    zip_t zip_s = {0}, *zip = &zip_s;
+    zip->path = path;
+    zip->mem = mem;
+    mem->repl.len = mem->out.len = 0;
+    zip->log = stdout;
+    zip->in = fopen(path, "r+b");
+    zip->opt.fix = 1;
+    if (setjmp(zip->env))               // prepare for throw()
+        return;
+    if (zip->in == NULL)
+        throw(zip, "failed to open (for writing)");
+    zip_map(zip);
+    if (!S_ISREG(zip->st.st_mode) ||
+        le8(rec + 8) != (uint64_t)zip->st.st_dev ||
+        le8(rec + 16) != (uint64_t)zip->st.st_ino ||
+        le8(rec + 24) != (uint64_t)zip->size)
+        throw(zip, "different file than journaled at");
+
+    // Check that all of the names are as written or as journaled, and then
+    // write back the journaled names that were replaced.
+    uint32_t n = le4(rec + 32);
+    unsigned char buf[MAX16];
+    for (int write = 0; write < 2; write++) {
+        unsigned char const *p = rec + 38 + plen;
+        for (uint32_t i = 0; i < n; i++) {
+            unsigned nlen = le2(p + 16), skip = p[18];
+            unsigned char const *name = p + 19, *repl = name + nlen;
+            for (int k = 0; k < 2; k++) {
+                uint64_t at = le8(p + 8 * k);
+                if (at == UINT64_MAX)
+                    continue;           // no Unicode path in local header
+                unsigned char const *now = peek(zip, at, nlen, buf);
+                if (memcmp(now, name, nlen) == 0)
+                    continue;
+                if (memcmp(now, repl, nlen))
+                    throw(zip, "names changed since journaled in");
+                if (write) {
+                    struct iovec vec = {(void *)name, nlen};
+                    zip->mod = 1;
+                    put(zip, at, &vec, 1);
+                    if (k && nlen >= skip)
+                        say(zip, "%s: %.*s -> %.*s\n", path,
+                            nlen - skip, repl + skip, nlen - skip,
+                            name + skip);
+                }
+            }
+            p += 19 + 2 * nlen;
+        }
+    }
+    if (zip->mod)
+        zip_sync(zip);
+    zip_flush(zip, NULL);
+    zip_close(zip);
+}
+
+// Undo the changes recorded in the journal at path, most recent first. Return
+// 0 on success, or 1 if the journal could not be read.
+static int undo(char const *path) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "zipclean: could not open journal %s\n", path);
+        return 1;
+    }
+    buf_t all = {0};
+    size_t got;
+    do {
+        if (fits(&all, 65536)) {
+            fputs("zipclean: out of memory\n", stderr);
+            fclose(in);
+            return 1;
+        }
+        got = fread(all.buf + all.len, 1, 65536, in);
+        all.len += got;
+    } while (got);
+    int err = ferror(in);
+    fclose(in);
+    if (err) {
+        fprintf(stderr, "zipclean: could not read journal %s\n", path);
+        free(all.buf);
+        return 1;
+    }
+
+    // Find the complete records, and then undo them in reverse order.
+    pthread_once(&crc_once, crc_make);
+    buf_t list = {0};
+    size_t pos = 0;
+    while (all.len - pos >= 42) {
+        unsigned char const *rec = all.buf + pos;
+        size_t len = le4(rec + 4);
+        if (le4(rec) != JOURNAL || len < 42 || len > all.len - pos ||
+            crc32(0, rec, len - 4) != le4(rec + len - 4))
+            break;
+        if (fits(&list, sizeof(size_t))) {
+            fputs("zipclean: out of memory\n", stderr);
+            break;
+        }
+        *(size_t *)(list.buf + list.len) = pos;
+        list.len += sizeof(size_t);
+        pos += len;
+    }
+    if (pos != all.len)
+        fprintf(stderr, "zipclean: ignoring incomplete end of journal %s\n",
+                path);
+    arena_t mem = {0};
+    for (size_t k = list.len / sizeof(size_t); k; k--) {
+        size_t at = ((size_t *)list.buf)[k - 1];
+        zip_undo(all.buf + at, &mem);
+    }
+    arena_free(&mem);
+    free(list.buf);
+    free(all.buf);
+    return 0;
+}
+
+// Entries in a part of the central directory, scanned by one thread.
+typedef struct {
+    zip_t zip;              // copy of the zip_t limited to this part
+    arena_t mem;            // replacement names, patches, and report
+    uint64_t num;           // number of entries in this part
+    pthread_t tid;          // thread scanning this part
+    int run;                // true if tid was started
+    char msg[256];          // error message, or empty if none
+} part_t;
+
+// Scan the entries in a part of the central directory.
+static void *zip_part(void *arg) {
+    part_t *part = arg;
+    zip_t *zip = &part->zip;
+    if (setjmp(zip->env) == 0)
+        for (uint64_t n = part->num; n; n--) {
+            zip_entry(zip);
+            if ((n & 0xfff) == 0)
+                zip_due(zip);
+        }
+    return NULL;
+}
+
+// Scan the n entries of the central directory starting at zip->pos using up to
+// zip->opt.split threads, each with at least SPLIT entries. The header
+// boundaries are found in a quick pass using just the lengths, which divides
+// the central directory into parts with equal numbers of entries. Each part is
+// scanned by zip_entry() in its own thread, with its own memory for the
+// replacement names, patches, and report. Those are then appended in order to
+// zip's, as if the entries had been scanned one by one.
+static void zip_split(zip_t *zip, uint64_t n) {
+    uint64_t most = n / SPLIT;
+    int ways = most < (uint64_t)zip->opt.split ? (int)most : zip->opt.split;
+    buf_t *tmp = &zip->mem->tmp;
+    tmp->len = 0;
+    part_t *part = (part_t *)grow(zip, tmp, ways * sizeof(part_t));
+    size_t pos = zip->pos;
+    for (int k = 0; k < ways; k++) {
+        part_t *p = part + k;
+        p->num = n / ways + ((uint64_t)k < n % ways);
+        p->zip = *zip;
+        p->zip.pos = pos;
+        for (uint64_t i = 0; i < p->num; i++) {
+            if (zip->len - pos < 46)
+                throw(zip, "truncated central directory in");
+            unsigned char const *head = zip->dir + pos;
+            pos += 46 + (size_t)le2(head + 28) + le2(head + 30) +
+                   le2(head + 32);
+            if (pos > zip->len)
+                throw(zip, "truncated central directory in");
+        }
+        p->zip.len = pos;
+        p->zip.mem = &p->mem;
+        p->zip.num = 0;
+        p->zip.count = (tally_t){0};
+        p->zip.fail = p->msg;
+        p->mem = (arena_t){0};
+        p->msg[0] = 0;
+        p->run = 0;
+    }
+    zip->pos = pos;
+
+    // Scan the parts, using this thread for the first one.
+    for (int k = 1; k < ways; k++)
+        part[k].run = pthread_create(&part[k].tid, NULL, zip_part,
+                                     part + k) == 0;
+    zip_part(part);
+    for (int k = 1; k < ways; k++)
+        if (part[k].run)
+            pthread_join(part[k].tid, NULL);
+        else
+            zip_part(part + k);
+
+    // Find the first error, if any, and what memory will be needed. With an
+    // error, only the reports up to it are kept.
+    int last = ways;
+    char const *msg = NULL;
+    size_t repl = 0, list = 0, out = 0;
+    for (int k = 0; k < last; k++) {
+        if (part[k].msg[0]) {
+            msg = part[k].msg;
+            last = k + 1;
+        }
+        repl += part[k].mem.repl.len;
+        list += part[k].mem.patch.len;
+        out += part[k].mem.out.len;
+    }
+    arena_t *mem = zip->mem;
+    int full = fits(&mem->out, out) ||
+               (msg == NULL && (fits(&mem->repl, repl) ||
+                                fits(&mem->patch, list)));
+
+    // Append the results of the parts in order.
+    for (int k = 0; k < ways; k++) {
+        part_t *p = part + k;
+        if (k < last && !full) {
+            memcpy(mem->out.buf + mem->out.len, p->mem.out.buf,
+                   p->mem.out.len);
+            mem->out.len += p->mem.out.len;
+        }
+        if (msg == NULL && !full) {
+            size_t base = mem->repl.len;
+            memcpy(mem->repl.buf + base, p->mem.repl.buf, p->mem.repl.len);
+            mem->repl.len += p->mem.repl.len;
+            patch_t *add = (patch_t *)p->mem.patch.buf;
+            for (size_t i = 0; i < p->zip.num; i++) {
+                add[i].repl += base;
+                ((patch_t *)(mem->patch.buf + mem->patch.len))[i] = add[i];
+            }
+            mem->patch.len += p->mem.patch.len;
+            zip->num += p->zip.num;
+        }
+        if (k < last)
+            zip->count.entries += p->zip.count.entries;
+        arena_free(&p->mem);
+    }
+    if (full)
+        throw(zip, "out of memory");
+    zip->last = part[ways - 1].zip.last;
+    if (msg != NULL) {
+        char err[256];
+        strcpy(err, msg);
+        throw(zip, "%s", err);
+    }
+}
+
+// Connection to an HTTP server for reading remote zip files with Range
+// requests, kept open from one zip file to the next on the same server. The
+// bytes received for the last request are kept in win, so that the smaller
+// reads within them that follow don't need more requests.
+typedef struct net_s {
+    char host[256];         // host and optional port of the connection
+    int sock;               // connected socket, or -1 if not connected
+    buf_t win;              // bytes received for the last request
+    off_t at;               // offset of win.buf[] in the zip file
+} net_t;
+
+// Close the connection, if open.
+static void net_close(net_t *net) {
+    if (net->sock != -1) {
+        close(net->sock);
+        net->sock = -1;
+    }
+}
+
+// Connect to host, which is len bytes, and is a host name or address,
+// optionally followed by a colon and a port number. The default port is 80.
+static void net_connect(zip_t *zip, char const *host, size_t len) {
+    net_t *net = zip->net;
+    net_close(net);
+    if (len >= sizeof(net->host))
+        throw(zip, "host name too long in");
+    memcpy(net->host, host, len);
+    net->host[len] = 0;
+    char name[sizeof(net->host)];
+    strcpy(name, net->host);
+    char *port = name[0] == '[' ? strchr(name, ']') : name;
+    port = port == NULL ? NULL : strrchr(port, ':');
+    if (port != NULL)
+        *port++ = 0;
+    char *addr = name;
+    if (*addr == '[') {
+        addr++;
+        addr[strcspn(addr, "]")] = 0;
+    }
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *list;
+    zip->count.calls++;
+    int ret = getaddrinfo(addr, port == NULL || *port == 0 ? "80" : port,
+                          &hints, &list);
+    if (ret) {
+        net->host[0] = 0;
+        throw(zip, "could not look up host (%s) for", gai_strerror(ret));
+    }
+    for (struct addrinfo *ai = list; ai != NULL; ai = ai->ai_next) {
+        zip->count.calls += 2;
+        net->sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (net->sock == -1)
+            continue;
+        if (connect(net->sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        net_close(net);
+    }
+    freeaddrinfo(list);
+    if (net->sock == -1) {
+        net->host[0] = 0;
+        throw(zip, "could not connect (%s) for", strerror(errno));
+    }
+    struct timeval wait = {30, 0};
+    zip->count.calls += 2;
+    setsockopt(net->sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+    setsockopt(net->sock, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    zip->count.calls++;
+    setsockopt(net->sock, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+#ifndef MSG_NOSIGNAL
+#  define MSG_NOSIGNAL 0
+#endif
+
+// Close the connection and throw an error for the remote zip file.
+static noreturn void net_fail(zip_t *zip, char const *msg) {
+    net_close(zip->net);
+    throw(zip, "%s", msg);
+}
+
+// Send the request req[0..len-1], and receive the response header into
+// head[0..size-1], nul-terminated. Return the length of what was received,
+// which may include some of the body. A connection kept open from before that
+// the server has since closed is reopened, and the request sent again.
+static size_t net_ask(zip_t *zip, char const *host, size_t hlen,
+                      char const *req, size_t len, char *head, size_t size) {
+    net_t *net = zip->net;
+    for (int again = 1;; again = 0) {
+        int reused = net->sock != -1 && strlen(net->host) == hlen &&
+                     memcmp(net->host, host, hlen) == 0;
+        if (!reused)
+            net_connect(zip, host, hlen);
+        size_t sent = 0;
+        int err = 0;
+        while (sent < len) {
+            zip->count.calls++;
+            ssize_t n = send(net->sock, req + sent, len - sent, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                err = n ? errno : 0;
+                break;
+            }
+            sent += n;
+        }
+        size_t have = 0;
+        if (sent == len)
+            for (;;) {
+                zip->count.reads++;
+                ssize_t n = recv(net->sock, head + have, size - 1 - have, 0);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    err = n ? errno : 0;
+                    break;
+                }
+                have += n;
+                head[have] = 0;
+                if (strstr(head, "\r\n\r\n") != NULL)
+                    return have;
+                if (have == size - 1)
+                    net_fail(zip, "HTTP response header too long for");
+            }
+        if (!(reused && again && have == 0))
+            net_fail(zip, have ? "premature end of HTTP response for" :
+                          err == EAGAIN ? "timed out waiting for server for" :
+                                            "lost connection to server for");
+        net_close(net);
+    }
+}
+
+// Request the bytes in range from the remote zip file at the http:// URL
+// zip->path, where range is the part of an HTTP Range header after "bytes=".
+// The bytes received are put in the window, and their offset in the zip file
+// in net->at. Return the length of the zip file, per the server.
+static off_t net_range(zip_t *zip, char const *range) {
+    // Send the request.
+    net_t *net = zip->net;
+    char const *host = zip->path + 7;
+    size_t hlen = strcspn(host, "/");
+    char const *path = host[hlen] ? host + hlen : "/";
+    char req[strlen(path) + hlen + strlen(range) + 80];
+    size_t len = snprintf(req, sizeof(req),
+                          "GET %s HTTP/1.1\r\nHost: %.*s\r\n"
+                          "Range: bytes=%s\r\nUser-Agent: zipclean\r\n\r\n",
+                          path, (int)hlen, host, range);
+    char head[8192];
+    size_t have = net_ask(zip, host, hlen, req, len, head, sizeof(head));
+
+    // Process the response header.
+    int code = 0, done = 0, chunked = 0;
+    uintmax_t beg = 0, last = 0, total = UINTMAX_MAX, size = UINTMAX_MAX;
+    sscanf(head, "HTTP/%*d.%*d %d", &code);
+    char *end = strstr(head, "\r\n\r\n");
+    for (char *line = strstr(head, "\r\n") + 2; line < end;
+         line = strstr(line, "\r\n") + 2) {
+        if (strncasecmp(line, "content-length:", 15) == 0)
+            size = strtoumax(line + 15, NULL, 10);
+        else if (strncasecmp(line, "content-range:", 14) == 0) {
+            char *p = line + 14;
+            p += strspn(p, " \t");
+            if (strncasecmp(p, "bytes ", 6) == 0) {
+                p += 6;
+                if (*p == '*')
+                    p++;
+                else {
+                    beg = strtoumax(p, &p, 10);
+                    if (*p == '-')
+                        last = strtoumax(p + 1, &p, 10);
+                }
+                if (*p == '/')
+                    total = strtoumax(p + 1, NULL, 10);
+            }
+        }
+        else if (strncasecmp(line, "transfer-encoding:", 18) == 0)
+            chunked = strstr(line, "chunked") != NULL;
+        else if (strncasecmp(line, "connection:", 11) == 0)
+            done = strstr(line, "close") != NULL;
+    }
+    if (code == 416 && total != UINTMAX_MAX) {
+        // The range is past the end, such as for an empty file.
+        net_close(net);
+        net->win.len = 0;
+        net->at = total;
+        return total;
+    }
+    if (code == 200)
+        net_fail(zip, "HTTP server ignored Range request for");
+    if (code != 206) {
+        net_close(net);
+        throw(zip, "HTTP status %d for", code);
+    }
+    if (chunked || total == UINTMAX_MAX || last < beg || last >= total ||
+        total > (uintmax_t)INTMAX_MAX || last - beg >= SIZE_MAX ||
+        (size != UINTMAX_MAX && size != last - beg + 1))
+        net_fail(zip, "unusable HTTP response for");
+
+    // Receive the body into the window.
+    len = last - beg + 1;
+    net->win.len = 0;
+    unsigned char *win = grow(zip, &net->win, len);
+    size_t got = have - (end + 4 - head);
+    if (got > len)
+        net_fail(zip, "unusable HTTP response for");
+    memcpy(win, end + 4, got);
+    while (got < len) {
+        zip->count.reads++;
+        ssize_t n = recv(net->sock, win + got, len - got, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            net_fail(zip, n == -1 && errno == EAGAIN ?
+                          "timed out waiting for server for" :
+                          "premature end of HTTP response for");
+        got += n;
+    }
+    if (done)
+        net_close(net);
+    net->win.len = len;
+    net->at = beg;
+    return total;
+}
+
+// Read len bytes at offset at from a remote zip file, for peek(). If they are
+// not in the window, then request them. Copy them to buf[] and return buf, or
+// if buf is NULL, return a pointer to them in the window.
+static unsigned char const *net_get(zip_t *zip, off_t at, size_t len,
+                                    unsigned char *buf) {
+    net_t *net = zip->net;
+    if (len == 0)
+        return buf;
+    if (at < net->at || (uintmax_t)(at - net->at) > net->win.len ||
+        net->win.len - (at - net->at) < len) {
+        char range[48];
+        snprintf(range, sizeof(range), "%jd-%jd",
+                 (intmax_t)at, (intmax_t)(at + len - 1));
+        net_range(zip, range);
+        if (net->at != at || net->win.len != len)
+            net_fail(zip, "unusable HTTP response for");
+    }
+    unsigned char const *p = net->win.buf + (at - net->at);
+    if (buf == NULL)
+        return p;
+    memcpy(buf, p, len);
+    return buf;
+}
+
+// Open the remote zip file at the http:// URL zip->path, and get its length.
+// The request gets the last bytes, where the end record would be, so that
+// zip_end() needs no more.
+static void net_open(zip_t *zip, job_t *job) {
+    if (job->net == NULL) {
+        job->net = calloc(1, sizeof(net_t));
+        if (job->net == NULL)
+            throw(zip, "out of memory for");
+        job->net->sock = -1;
+    }
+    zip->net = job->net;
+    zip->get = net_get;
+    char range[24];
+    snprintf(range, sizeof(range), "-%d", ZLOCLEN + ENDLEN + MAX16);
+    zip->size = net_range(zip, range);
+}
+
+// Close the connection and free the window, if there was a remote zip file.
+static void net_free(net_t *net) {
+    if (net == NULL)
+        return;
+    net_close(net);
+    free(net->win.buf);
+    free(net);
+}
+
+// Clean the zip file path. If job->opt.fix is zero, then report changes that
+// would be made, but don't make them. If probe is true, then path may not be a
+// zip file, in which case it is silently skipped. If job->opt.quick is true,
+// then just find out whether there are any names to fix, stopping at the first
+// one, and without checking the local headers. Nothing is reported but errors,
+// and the summary in JSON mode. If there is a cache, then a zip file in it
+// that hasn't changed is skipped, after checking that its end record is still
+// there, and a newly clean zip file is added to it. If the cache is for
+// growing zip files, then only the entries added since a zip file was found
+// clean are scanned. If job->opt.verify is true, then the local headers of all
+// of the entries scanned are checked against the central directory, not just
+// those with names to fix. If job->opt.overlap is true, then all of the
+// entries are checked for overlaps, and if job->opt.collide is true, for fixed
+// names that collide with other names. If
+// job->opt.direct is true, then the central directory is read with O_DIRECT if
+// possible, and if job->opt.drop is true, the zip file is dropped from the
+// page cache when done. If job->fd is not -1, then it is the zip file, which
+// is closed when done, and path is only its name for the report. The zip file
+// is given up on if it goes over any of the limits in job->opt.max.
+static void zip_clean(char *path, int probe, job_t *job) {
+    // Open the zip file.
+    zip_t zip_s = {0}, *zip = &zip_s;
+    int fix = job->opt.fix;
+    arena_t *mem = &job->mem;
+    zip->path = path;
+    zip->mem = mem;
+    mem->repl.len = mem->patch.len = mem->out.len = 0;
+    zip->opt = job->opt;
+    if (zip->opt.max.time)
+        zip->due = now() + zip->opt.max.time;
+    zip->dest = -1;
+    if (job->opt.keep)
+        zip->keep = zip_keep;
+    if (job->fd != -1 && (!fix || zip->opt.copy != NULL ||
+                          (fcntl(job->fd, F_GETFL) & O_ACCMODE) != O_RDONLY))
+        // Use the zip file provided instead of opening path, if it can be
+        // written when fixing in place. Otherwise it's closed below, after
+        // finding out why it couldn't be used.
+        zip->in = fdopen(job->fd, fix && zip->opt.copy == NULL ? "r+b" : "rb");
+    else if (strncmp(path, "http://", 7) != 0) {
+        zip->in = fopen(path, fix && zip->opt.copy == NULL ? "r+b" : "rb");
+        zip->count.calls++;
+    }
+    zip->mod = 0;
+    zip->probe = probe;
+    zip->log = job->log;
+    zip->sum = &job->sum;
+    if (setjmp(zip->env))               // prepare for throw()
+        return;
+    int remote = job->fd == -1 && strncmp(path, "http://", 7) == 0;
+    if (remote) {
+        if (fix)
+            throw(zip, "can only check, not fix, a remote zip file");
+        net_open(zip, job);
+    }
+    else if (zip->in == NULL) {
+        if (job->fd != -1) {
+            int flags = fcntl(job->fd, F_GETFL);
+            close(job->fd);
+            if (fix && zip->opt.copy == NULL &&
+                (flags & O_ACCMODE) == O_RDONLY)
+                throw(zip, "descriptor not opened for writing for");
+        }
+        if (strncmp(path, "https://", 8) == 0 ||
+            strncmp(path, "s3://", 5) == 0)
+            throw(zip, "only http:// URLs are supported, not");
+        throw(zip, "failed to open%s",
+              fix && zip->opt.copy == NULL ? " (for writing)" : "");
+    }
+
+    // Find the central directory and load it into memory, either by mapping
+    // the whole zip file, or with a single read, or for a remote zip file, a
+    // single request after the one for the end. Then find the names that need
+    // fixing, and fix them as requested. The file is only revisited for the
+    // local headers of those entries.
+    if (!remote)
+        zip_map(zip);
+    clean_t const *was = NULL;
+    uint64_t want = cache_checks(&zip->opt);
+    if (job->cache != NULL && S_ISREG(zip->st.st_mode)) {
+        size_t k = *cache_slot(job->cache, &zip->st);
+        if (k) {
+            was = job->cache->rec + k - 1;
+            unsigned char buf[4];
+            if ((was->checks & want) == want &&
+                was->size == (uint64_t)zip->st.st_size &&
+                was->mtime == mtime(&zip->st) &&
+                le4(peek(zip, was->end, 4, buf)) == END) {
+                zip->probe = 0;
+                zip->count.cached = 1;
+                zip_stats(zip, NULL);
+                zip_flush(zip, NULL);
+                zip_close(zip);
+                return;
+            }
+        }
+    }
+    uint64_t n = zip_dir(zip, &zip->beg, &zip->len);
+    double start = now();
+    if (zip->opt.direct)
+        zip->dir = zip_direct(zip);
+    else if (zip->in != NULL && zip->len >= AHEAD) {
+        // Have the kernel read all of a large central directory at once.
+        zip->count.calls++;
+        advise(fileno(zip->in), zip->beg, zip->len, 0);
+    }
+    if (zip->dir == NULL)
+        zip->dir = peek(zip, zip->beg, zip->len,
+                        scratch(zip, &mem->dir, zip->len));
+    if (n == 0 || (zip->len >= 4 && le4(zip->dir) == CENTRAL))
+        zip->probe = 0;                 // looks like a zip file
+    uint64_t total = n;
+    size_t end;
+    if (job->cache != NULL && job->cache->grow && was != NULL &&
+        S_ISREG(zip->st.st_mode) && was->num && was->num < n &&
+        (was->checks & want & CHECK_VERIFY) == (want & CHECK_VERIFY) &&
+        was->local < was->beg && was->beg <= (uint64_t)zip->beg &&
+        was->len < zip->len &&
+        zip->len - was->len >= 46 && le4(zip->dir + was->len) == CENTRAL &&
+        (uint64_t)cache_local(zip, was->last, &end) == was->local &&
+        end == was->len) {
+        // A zip file that was appended to, with the central directory
+        // rewritten after the new entries, has the old central directory at
+        // the start of the new one, which starts no earlier than the old one
+        // did. If the old last header is still in the same place, with the
+        // same local header offset before the old central directory, and is
+        // followed by a central header at the old length, then only scan the
+        // entries after that. The old entries are taken to be unchanged, since
+        // the zip file was only appended to. With --verify, the old entries
+        // must have been verified before, since only the new ones will be. The
+        // --overlap and --collisions checks always include the old entries.
+        zip->pos = was->len;
+        n -= was->num;
+    }
+    size_t first = zip->pos;
+    uint64_t scan = n;
+    if (zip->opt.split > 1 && !zip->opt.quick && n >= 2 * (uint64_t)SPLIT) {
+        zip_split(zip, n);
+        n = 0;
+    }
+    while (n && !(zip->opt.quick && zip->num)) {
+        zip_entry(zip);
+        if ((--n & 0xfff) == 0)
+            zip_due(zip);
+    }
+    double mid = now();
+    zip->count.dir = mid - start;
+    if (zip->opt.collide && zip->num && !zip->probe)
+        zip_collide(zip, total);
+    if ((zip->opt.verify || zip->opt.overlap) && !zip->probe)
+        zip_check(zip, first, total - scan, scan);
+    if (job->cache != NULL && S_ISREG(zip->st.st_mode) && zip->num == 0 &&
+        !zip->probe)
+        cache_save(job, zip, total);
+    if (!zip->opt.quick)
+        zip_local(zip);
+    zip->count.local = now() - mid;
+    zip_stats(zip, NULL);
+    zip_flush(zip, NULL);
+    zip_close(zip);
+}
+
+// Input buffer for cleaning a zip file streamed from stdin to stdout.
+typedef struct {
+    zip_t *zip;             // zip file information, for errors and fixing
+    unsigned char *buf;     // input buffer
+    size_t size;            // allocated size of buf[]
+    size_t next;            // offset of the next unprocessed byte in buf[]
+    size_t have;            // number of unprocessed bytes at buf + next
+    int eof;                // true if the end of the input was reached
+} stream_t;
+
+// Try to have at least n bytes available at s->buf + s->next, which can only
+// fail at the end of the input. n must be no more than s->size. Return the
+// number of bytes available.
+static size_t fill(stream_t *s, size_t n) {
+    if (s->have >= n || s->eof)
+        return s->have;
+    memmove(s->buf, s->buf + s->next, s->have);
+    s->next = 0;
+    while (s->have < n && !s->eof) {
+        size_t got = fread(s->buf + s->have, 1, s->size - s->have, stdin);
+        s->zip->count.reads++;
+        s->zip->count.got += got;
+        if (got == 0) {
+            if (ferror(stdin))
+                throw(s->zip, "read error %s on", strerror(errno));
+            s->eof = 1;
+        }
+        s->have += got;
+    }
+    return s->have;
+}
+
+// Return a pointer to the next n bytes of input, which must be there.
+static unsigned char *need(stream_t *s, size_t n) {
+    if (fill(s, n) < n)
+        throw(s->zip, "premature EOF on");
+    return s->buf + s->next;
+}
+
+// Write the next n bytes of input, which are available, to stdout.
+static void emit(stream_t *s, size_t n) {
+    if (fwrite(s->buf + s->next, 1, n, stdout) != n)
+        throw(s->zip, "write error %s on", strerror(errno));
+    s->zip->count.writes++;
+    s->zip->count.put += n;
+    s->next += n;
+    s->have -= n;
+}
+
+// Copy the next len bytes of input to stdout, in chunks as large as the input
+// buffer. If len is UINT64_MAX, then copy to the end of the input.
+static void pass(stream_t *s, uint64_t len) {
+    while (len) {
+        size_t got = fill(s, s->size);
+        if (got == 0) {
+            if (len == UINT64_MAX)
+                return;
+            throw(s->zip, "premature EOF on");
+        }
+        if (got > len)
+            got = len;
+        emit(s, got);
+        if (len != UINT64_MAX)
+            len -= got;
+    }
+}
+
+// Return true if sig is the signature of a header that can follow entry data
+// and its descriptor.
+static int zip_head(uint32_t sig) {
+    return sig == LOCAL || sig == CENTRAL || sig == DIGSIG || sig == EXTRA ||
+           sig == ZIP64END || sig == END;
+}
+
+// Copy entry data of unknown length, and the data descriptor that follows it,
+// to stdout. The end of the data is found by looking for a descriptor whose
+// compressed length is the number of bytes of data so far, and that is
+// followed by another header. The descriptor may or may not start with its
+// signature. wide is true for a zip64 descriptor with 64-bit lengths.
+static void zip_unsized(stream_t *s, int wide) {
+    size_t dlen = wide ? 20 : 12;       // descriptor length after signature
+    size_t look = 4 + dlen + 4;         // longest candidate to check
+    uint64_t count = 0;                 // number of data bytes copied so far
+    for (;;) {
+        size_t have = fill(s, s->size);
+        unsigned char const *p = s->buf + s->next;
+        size_t i = 0;
+        for (; i + look <= have || (s->eof && i + dlen + 4 <= have); i++) {
+            // Check for a descriptor starting at p + i, with a signature or
+            // without.
+            size_t n = p[i] == 'P' && i + look <= have && le4(p + i) == DESC ?
+                        4 : 0;
+            if (n == 0 && p[i + dlen] != 'P')
+                continue;
+            uint64_t clen = wide ? le8(p + i + n + 4) : le4(p + i + n + 4);
+            if (clen == count + i && zip_head(le4(p + i + n + dlen))) {
+                emit(s, i);
+                emit(s, n + dlen);
+                return;
+            }
+        }
+        if (s->eof)
+            throw(s->zip, "data descriptor not found in");
+        emit(s, i);
+        count += i;
+    }
+}
+
+// Fix the name and Unicode path, if any, of the header in the input buffer,
+// with the name at zip->name and the extra field at zip->extra. Report and
+// count the fixes if tell is true.
+static void zip_stream_fix(zip_t *zip, unsigned nlen, unsigned xlen,
+                           int tell) {
+    zip->mem->repl.len = 0;
+    unsigned char *name = (unsigned char *)zip->name;
+    unsigned char *repl = zip_fix(zip, name, nlen);
+    size_t at = repl == NULL ? 0 : repl - zip->mem->repl.buf;
+    unsigned ulen;
+    unsigned char *upath = (unsigned char *)zip_upath(zip->extra, xlen, &ulen);
+    unsigned char *urepl = upath == NULL ? NULL :
+                           zip_ufix(zip, upath, ulen, name, nlen, repl);
+    if (repl != NULL) {
+        repl = zip->mem->repl.buf + at;
+        if (tell) {
+            say_fix(zip, name, repl, nlen);
+            zip->num++;
+        }
+        memcpy(name, repl, nlen);
+    }
+    if (urepl != NULL) {
+        if (tell) {
+            say_fix(zip, upath + 4, urepl + 4, ulen - 4);
+            zip->num++;
+        }
+        memcpy(upath, urepl, ulen);
+    }
+}
+
+// Process the local header at the start of the input, fixing its name if
+// needed, and copy it, the entry data, and any data descriptor to stdout.
+static void zip_stream_local(stream_t *s) {
+    zip_t *zip = s->zip;
+    unsigned char *head = need(s, 30);
+    unsigned flag = le2(head + 6);
+    uint64_t clen = le4(head + 18);
+    unsigned nlen = le2(head + 26);
+    unsigned xlen = le2(head + 28);
+    head = need(s, 30 + nlen + xlen);
+    zip->name = head + 30;
+    zip->extra = head + 30 + nlen;
+
+    // Fix the name in the buffer, if needed. The fix will be reported when
+    // the central directory header is processed.
+    zip_stream_fix(zip, nlen, xlen, 0);
+
+    // See if this is a zip64 entry, and if so, get the compressed length from
+    // the zip64 extra field if needed. In a local header, that field has both
+    // lengths, whichever ones are MAX32, so the compressed length is always
+    // after the uncompressed length. A field too short for that is an error.
+    int wide = 0;
+    for (size_t i = 0; i + 3 < xlen; i += 4 + le2(zip->extra + i + 2))
+        if (le2(zip->extra + i) == 1)
+            wide = 1;
+    if (clen == MAX32)
+        clen = zip64_field(zip, xlen, 8);
+    emit(s, 30 + nlen + xlen);
+
+    // Copy the entry data and the data descriptor, if any. If the compressed
+    // length is known, use it. Otherwise the data has to be searched for the
+    // descriptor.
+    if ((flag & 8) && clen == 0)
+        zip_unsized(s, wide);
+    else {
+        pass(s, clen);
+        if (flag & 8)
+            pass(s, (le4(need(s, 4)) == DESC ? 4 : 0) + (wide ? 20 : 12));
+    }
+}
+
+// Process the central directory header at the start of the input, fixing and
+// reporting its name if needed, and copy it to stdout.
+static void zip_stream_central(stream_t *s) {
+    zip_t *zip = s->zip;
+    unsigned char *head = need(s, 46);
+    unsigned nlen = le2(head + 28);
+    unsigned xlen = le2(head + 30);
+    unsigned clen = le2(head + 32);
+    head = need(s, 46 + nlen + xlen + clen);
+    zip->name = head + 46;
+    zip->extra = head + 46 + nlen;
+    zip->count.entries++;
+    zip_stream_fix(zip, nlen, xlen, 1);
+    emit(s, 46 + nlen + xlen + clen);
+}
+
+// Clean a zip file streamed from stdin, writing the result to stdout. The
+// input is processed front to back, copying everything but fixed names as is.
+// Since the names don't change length, all of the offsets in the zip file
+// remain valid. A name in a local header is fixed by itself by the same rules
+// as its central directory name, so those will still match. No more than the
+// largest header is held in memory, with entry data copied through in large
+// chunks. Changes are reported to stderr, as are the counts if stats is true,
+// in JSON Lines format if json is true. Return 0 on success, or 1 if there was
+// an error, in which case the output is incomplete and should be discarded.
+static int zip_stream(arena_t *mem, int stats, int json) {
+    zip_t zip_s = {0}, *zip = &zip_s;
+    zip->path = "(stdin)";
+    zip->mem = mem;
+    zip->opt.stats = stats;
+    zip->opt.json = json;
+    zip->log = stderr;
+    stream_t strm = {zip, NULL, 0, 0, 0, 0}, *s = &strm;
+    if (setjmp(zip->env))               // prepare for throw()
+        return 1;
+
+    // Allocate an input buffer large enough for any header.
+    s->size = 46 + 3 * MAX16 + 1;
+    s->buf = grow(zip, &mem->tmp, s->size);
+
+    // Process the headers in order, until the end record.
+    if (fill(s, 4) >= 4 && le4(s->buf) == DESC)
+        emit(s, 4);                     // split archive marker
+    for (;;) {
+        uint32_t sig = le4(need(s, 4));
+        if (sig == LOCAL)
+            zip_stream_local(s);
+        else if (sig == CENTRAL)
+            zip_stream_central(s);
+        else if (sig == DIGSIG)
+            pass(s, 6 + le2(need(s, 6) + 4));
+        else if (sig == EXTRA)
+            pass(s, 8 + (uint64_t)le4(need(s, 8) + 4));
+        else if (sig == ZIP64END)
+            pass(s, 12 + le8(need(s, 12) + 4));
+        else if (sig == ZIP64LOC)
+            pass(s, ZLOCLEN);
+        else if (sig == END) {
+            pass(s, ENDLEN + le2(need(s, ENDLEN) + ENDLEN - 2));
+            break;
+        }
+        else
+            throw(zip, "unknown header in");
+    }
+
+    // Copy anything after the end record, and finish up.
+    pass(s, UINT64_MAX);
+    if (fflush(stdout))
+        throw(zip, "write error %s on", strerror(errno));
+    zip_stats(zip, NULL);
+    zip_flush(zip, NULL);
+    return 0;
+}
+
+// Kinds of queued paths.
+enum { ZIP, PROBE, TREE };
+
+// Queued path to process.
+typedef struct item_s {
+    struct item_s *next;    // next item in the queue
+    int kind;               // ZIP, PROBE (might be a zip file), or TREE
+    int hint;               // true if the file has been prefetched
+    char path[];            // path of the file or directory
+} item_t;
+
+// Queue of zip files and directories to process, shared by the worker threads.
+typedef struct {
+    item_t *head;           // next item to process, or NULL if none queued
+    item_t **tail;          // where to link the next queued item
+    size_t pending;         // number of items queued or being processed
+    opts_t opt;             // settings
+    cache_t *cache;         // clean zip files from before, or NULL
+    size_t depth;           // number of queued zip files to prefetch
+    size_t ahead;           // number of queued zip files prefetched
+    item_t *next;           // next queued item to prefetch, or NULL
+    tally_t total;          // totals from the finished workers
+    int sock;               // listening socket for --serve
+    pthread_mutex_t lock;   // lock for the above
+    pthread_cond_t more;    // signaled when an item is queued or finished
+} work_t;
+
+// Complain about path to stderr, and count it as an error.
+static void complain(work_t *work, char const *msg, char const *path) {
+    pthread_mutex_lock(&report);
+    fprintf(stderr, "zipclean: %s %s -- skipping\n", msg, path);
+    pthread_mutex_unlock(&report);
+    pthread_mutex_lock(&work->lock);
+    work->total.errors++;
+    pthread_mutex_unlock(&work->lock);
+}
+
+// Queue path, which is len bytes at dir, joined with name if not NULL.
+static void enqueue(work_t *work, int kind, char const *dir, size_t len,
+                    char const *name) {
+    size_t more = name == NULL ? 0 : 1 + strlen(name);
+    item_t *item = malloc(sizeof(item_t) + len + more + 1);
+    if (item == NULL) {
+        complain(work, "out of memory for", dir);
+        return;
+    }
+    item->next = NULL;
+    item->kind = kind;
+    item->hint = 0;
+    memcpy(item->path, dir, len);
+    if (name != NULL) {
+        item->path[len] = '/';
+        strcpy(item->path + len + 1, name);
+    }
+    else
+        item->path[len] = 0;
+    pthread_mutex_lock(&work->lock);
+    *work->tail = item;
+    work->tail = &item->next;
+    if (work->next == NULL)
+        work->next = item;
+    work->pending++;
+    pthread_cond_signal(&work->more);
+    pthread_mutex_unlock(&work->lock);
+}
+
+// Queue the entries in the directory path. Subdirectories are queued to be
+// walked in turn, so that any idle worker can list them. Regular files with a
+// .zip suffix are queued as zip files, and other regular files are queued to
+// be probed for an end of central directory record. Symbolic links are not
+// followed.
+static void walk(work_t *work, char const *path) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        complain(work, "could not open directory", path);
+        return;
+    }
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        char const *name = ent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        int type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            // The file system didn't say -- go ask.
+            char sub[len + strlen(name) + 2];
+            snprintf(sub, sizeof(sub), "%.*s/%s", (int)len, path, name);
+            struct stat st;
+            if (lstat(sub, &st))
+                continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR :
+                   S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR)
+            enqueue(work, TREE, path, len, name);
+        else if (type == DT_REG) {
+            size_t n = strlen(name);
+            enqueue(work, n > 4 && strcasecmp(name + n - 4, ".zip") == 0 ?
+                          ZIP : PROBE, path, len, name);
+        }
+    }
+    closedir(dir);
+}
+
+// Ask the kernel to start reading the end of the file path, where the end
+// record and usually the central directory are, without waiting for it.
+static void prefetch(char const *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t want = ZLOCLEN + ENDLEN + MAX16;
+        off_t beg = st.st_size > want ? st.st_size - want : 0;
+        advise(fd, beg, st.st_size - beg, 0);
+    }
+    close(fd);
+}
+
+// Take the next item off of the queue, or return NULL if there are none.
+// Prefetch queued zip files past that one, up to work->depth of them, so that
+// the device has that many reads to work on at once. Wait for more items if
+// the queue is empty but other workers are busy.
+static item_t *dequeue(work_t *work) {
+    char *list = NULL;
+    size_t len = 0;
+    pthread_mutex_lock(&work->lock);
+    while (work->head == NULL && work->pending)
+        pthread_cond_wait(&work->more, &work->lock);
+    item_t *item = work->head;
+    if (item != NULL) {
+        if ((work->head = item->next) == NULL)
+            work->tail = &work->head;
+        if (item->hint)
+            work->ahead--;
+        else if (work->next == item)
+            work->next = item->next;
+
+        // Copy the paths to prefetch, to do so after releasing the lock.
+        item_t *next = work->next;
+        size_t n = 0;
+        for (item_t *p = next; p != NULL && n + work->ahead < work->depth;
+             p = p->next)
+            if (p->kind != TREE) {
+                len += strlen(p->path) + 1;
+                n++;
+            }
+        if (len && (list = malloc(len)) != NULL) {
+            char *at = list;
+            while (n) {
+                if (next->kind != TREE) {
+                    at = stpcpy(at, next->path) + 1;
+                    next->hint = 1;
+                    work->ahead++;
+                    n--;
+                }
+                next = next->next;
+            }
+            work->next = next;
+        }
+    }
+    pthread_mutex_unlock(&work->lock);
+    if (list != NULL) {
+        for (char *at = list; at < list + len; at += strlen(at) + 1)
+            prefetch(at);
+        free(list);
+    }
+    return item;
+}
+
+// Set up job with the settings in work, reporting to stdout.
+static void job_init(job_t *job, work_t *work) {
+    *job = (job_t){.opt = work->opt, .log = stdout, .fd = -1,
+                   .cache = work->cache};
+}
+
+// Save what's left for the cache, add the totals from job to work, and free
+// the resources of job.
+static void job_free(job_t *job, work_t *work) {
+    if (job->cache != NULL)
+        cache_write(job->cache, &job->save);
+    free(job->save.buf);
+    net_free(job->net);
+    pthread_mutex_lock(&work->lock);
+    tally_add(&work->total, &job->sum);
+    pthread_mutex_unlock(&work->lock);
+    arena_free(&job->mem);
+}
+
+// Worker thread: process queued items until the queue is empty and no other
+// worker can add to it.
+static void *worker(void *arg) {
+    work_t *work = arg;
+    job_t job;
+    job_init(&job, work);
+    for (;;) {
+        // Get the next item, waiting for more if other workers are busy.
+        item_t *item = dequeue(work);
+        if (item == NULL) {
+            job_free(&job, work);
+            return NULL;
+        }
+
+        // Process the item.
+        if (item->kind == TREE)
+            walk(work, item->path);
+        else
+            zip_clean(item->path, item->kind == PROBE, &job);
+        free(item);
+
+        // Wake up all the waiting workers if that was the last one.
+        pthread_mutex_lock(&work->lock);
+        if (--work->pending == 0)
+            pthread_cond_broadcast(&work->more);
+        pthread_mutex_unlock(&work->lock);
+    }
+}
+
+// Descriptor received with a request on a --serve connection, for the request
+// line it came with.
+typedef struct {
+    int fd;                 // received descriptor
+    size_t line;            // number of the line it goes with
+} pass_t;
+
+// Most descriptors held for request lines not yet processed on a connection.
+#define PASS 64
+
+// Serve the requests on the connection conn until the client closes it. Each
+// request is a line with the path of a zip file, which is processed by
+// zip_clean() with the result written back on the connection as JSON Lines,
+// ending with the summary for that zip file. A request can send an open zip
+// file with SCM_RIGHTS instead, with a single line naming it for the result,
+// in which case the line is not opened as a path. Both end up closing conn.
+static void serve_conn(job_t *job, int conn) {
+    job->log = fdopen(conn, "w");
+    if (job->log == NULL) {
+        close(conn);
+        return;
+    }
+    buf_t in = {0};
+    pass_t pass[PASS];
+    size_t held = 0, line = 0, got = 0;
+    for (;;) {
+        // Receive more of the requests, with any descriptors. A read ends
+        // with the message that carried a descriptor, so the descriptor goes
+        // with the line that the last byte received is in. That's the line
+        // still in progress, or the one that byte ended.
+        if (fits(&in, 4096))
+            break;
+        union {
+            struct cmsghdr head;
+            char buf[CMSG_SPACE(PASS * sizeof(int))];
+        } ctl;
+        struct iovec vec = {in.buf + in.len, in.size - in.len};
+        struct msghdr msg = {.msg_iov = &vec, .msg_iovlen = 1,
+                             .msg_control = ctl.buf,
+                             .msg_controllen = sizeof(ctl.buf)};
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t n = recvmsg(conn, &msg, 0);
+#endif
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        size_t lines = 0;
+        for (ssize_t i = 0; i < n - 1; i++)
+            lines += in.buf[in.len + i] == '\n';
+        size_t with = got + lines;
+        lines += in.buf[in.len + n - 1] == '\n';
+        in.len += n;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+             c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t num = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < num; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (held == PASS)
+                    close(fd);
+                else
+                    pass[held++] = (pass_t){fd, with};
+            }
+        }
+        got += lines;
+
+        // Process the complete request lines.
+        char *p = (char *)in.buf, *end;
+        while ((end = memchr(p, '\n', (char *)in.buf + in.len - p)) != NULL) {
+            *end = 0;
+            if (end > p && end[-1] == '\r')
+                end[-1] = 0;
+            int fd = -1;
+            while (held && pass[0].line == line) {
+                if (fd == -1)
+                    fd = pass[0].fd;
+                else
+                    close(pass[0].fd);
+                memmove(pass, pass + 1, --held * sizeof(pass_t));
+            }
+            if (*p) {
+                job->fd = fd;
+                zip_clean(p, 0, job);
+                job->fd = -1;
+            }
+            else if (fd != -1)
+                close(fd);
+            line++;
+            p = end + 1;
+        }
+        in.len -= p - (char *)in.buf;
+        memmove(in.buf, p, in.len);
+    }
+    while (held)
+        close(pass[--held].fd);
+    free(in.buf);
+    if (job->cache != NULL)
+        cache_write(job->cache, &job->save);
+    fclose(job->log);
+    job->log = NULL;
+}
+
+// --serve thread: serve connections on the listening socket work->sock, one
+// at a time, until accept() fails. The zip files are read with stdio and not
+// mapped, since a client could truncate one while it's being read, which would
+// raise SIGBUS on an access to the mapping past the new end, taking down the
+// server. With stdio, a short read is just an error for that zip file.
+static void *server(void *arg) {
+    work_t *work = arg;
+    job_t job;
+    job_init(&job, work);
+    job.opt.json = 1;
+    job.opt.stdio = 1;
+    for (;;) {
+        int conn = accept(work->sock, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        serve_conn(&job, conn);
+    }
+    fprintf(stderr, "zipclean: could not accept (%s)\n", strerror(errno));
+    job_free(&job, work);
+    return NULL;
+}
+
+// Listen on the Unix socket at path, and serve connections with jobs threads,
+// one of which is this one, each reusing its memory from one zip file to the
+// next. A socket left at path is replaced. This only returns on failure, with
+// 1.
+static int serve(work_t *work, char const *path, long jobs) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "zipclean: socket path %s too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    work->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (work->sock == -1 ||
+        bind(work->sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(work->sock, 64)) {
+        fprintf(stderr, "zipclean: could not listen on %s (%s)\n", path,
+                strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);           // a client may leave early
+    work->opt.split = jobs;
+    pthread_t *tid = jobs > 1 ? malloc((jobs - 1) * sizeof(pthread_t)) : NULL;
+    long started = 0;
+    if (tid != NULL)
+        while (started < jobs - 1 &&
+               pthread_create(tid + started, NULL, server, work) == 0)
+            started++;
+    server(work);
+    while (started)
+        pthread_join(tid[--started], NULL);
+    free(tid);
+    close(work->sock);
+    return 1;
+}
+
+// Return the total number of I/O system calls in t.
+static uintmax_t tally_calls(tally_t const *t) {
+    return t->reads + t->seeks + t->writes + t->calls;
+}
+
+// Write a synthetic zip file to path with n empty entries, each with a name of
+// length nlen, of which bad per thousand need fixing. If z64 is true, then
+// every entry uses zip64 extra fields for its lengths and offset. A zip64 end
+// record is written if needed, or if z64 is true. The zip file comment is clen
+// bytes long. Return the length of the zip file, or -1 on error.
+static off_t bench_make(char const *path, uint64_t n, unsigned nlen,
+                        unsigned bad, int z64, unsigned clen) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+        return -1;
+    unsigned char head[46 + 28], name[MAX16 + 1];
+    unsigned llen = 30 + nlen + (z64 ? 20 : 0);     // local entry length
+
+    // Write the local headers and then the central directory headers.
+    for (int cen = 0; cen < 2; cen++)
+        for (uint64_t i = 0; i < n; i++) {
+            snprintf((char *)name, sizeof(name), "%0*ju", (int)nlen,
+                     (uintmax_t)i);
+            memset(name, 'a', nlen > 20 ? nlen - 20 : 0);
+            name[nlen > 1] = '/';
+            if (i % 1000 < bad)
+                memcpy(name, "../", nlen < 3 ? nlen : 3);
+            memset(head, 0, sizeof(head));
+            uint32_t len = z64 ? MAX32 : 0;
+            if (cen) {
+                set4(head, CENTRAL);
+                set2(head + 4, 45);
+                set2(head + 6, 45);
+                set4(head + 20, len);
+                set4(head + 24, len);
+                set2(head + 28, nlen);
+                set2(head + 30, z64 ? 28 : 0);
+                set4(head + 42, z64 ? MAX32 : i * llen);
+                set2(head + 46, 1);
+                set2(head + 48, 24);
+                set8(head + 66, i * llen);
+                if (fwrite(head, 1, 46, out) != 46 ||
+                    fwrite(name, 1, nlen, out) != nlen ||
+                    (z64 && fwrite(head + 46, 1, 28, out) != 28))
+                    break;
+            }
+            else {
+                set4(head, LOCAL);
+                set2(head + 4, 45);
+                set4(head + 18, len);
+                set4(head + 22, len);
+                set2(head + 26, nlen);
+                set2(head + 28, z64 ? 20 : 0);
+                set2(head + 30, 1);
+                set2(head + 32, 16);
+                if (fwrite(head, 1, 30, out) != 30 ||
+                    fwrite(name, 1, nlen, out) != nlen ||
+                    (z64 && fwrite(head + 30, 1, 20, out) != 20))
+                    break;
+            }
+        }
+
+    // Write the zip64 end records if needed, and the end record.
+    uint64_t dir = n * llen, size = ftello(out) - dir, end = dir + size;
+    int big = z64 || n >= MAX16 || dir >= MAX32 || size >= MAX32;
+    memset(head, 0, sizeof(head));
+    if (big) {
+        set4(head, ZIP64END);
+        set8(head + 4, 44);
+        set2(head + 12, 45);
+        set2(head + 14, 45);
+        set8(head + 24, n);
+        set8(head + 32, n);
+        set8(head + 40, size);
+        set8(head + 48, dir);
+        fwrite(head, 1, 56, out);
+        memset(head, 0, sizeof(head));
+        set4(head, ZIP64LOC);
+        set8(head + 8, end);
+        set4(head + 16, 1);
+        fwrite(head, 1, ZLOCLEN, out);
+    }
+    memset(head, 0, sizeof(head));
+    set4(head, END);
+    set2(head + 8, big ? MAX16 : n);
+    set2(head + 10, big ? MAX16 : n);
+    set4(head + 12, big ? MAX32 : size);
+    set4(head + 16, big ? MAX32 : dir);
+    set2(head + 20, clen);
+    fwrite(head, 1, ENDLEN, out);
+    memset(name, 'c', clen);
+    fwrite(name, 1, clen, out);
+    off_t len = ftello(out);
+    int err = ferror(out);
+    return fclose(out) || err ? -1 : len;
+}
+
+// Copy the file from to the file to. Return 0 on success, -1 on error.
+static int bench_copy(char const *from, char const *to) {
+    FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+    int ret = in == NULL || out == NULL ? -1 : 0;
+    unsigned char buf[65536];
+    size_t got;
+    while (ret == 0 && (got = fread(buf, 1, sizeof(buf), in)) > 0)
+        if (fwrite(buf, 1, got, out) != got)
+            ret = -1;
+    if (in != NULL && (ferror(in) | fclose(in)))
+        ret = -1;
+    if (out != NULL && fclose(out))
+        ret = -1;
+    return ret;
+}
+
+// Time zip_clean() on synthetic zip files with from 1 to max entries, going up
+// by factors of ten, both without and with fixing. Entries are zip32 or zip64,
+// with short or long names, some of which need fixing, and the zip file may
+// have a maximum-length comment. The dry runs are repeated for at least a
+// fifth of a second to get a stable rate. Report entries per second, megabytes
+// of zip file per second, and I/O system calls per entry. The zip files are
+// written to a temporary directory in $TMPDIR, or /tmp. Return 0 on success, or
+// 1 on failure.
+static int bench(uint64_t max) {
+    static struct {
+        unsigned nlen;      // name length
+        unsigned bad;       // names per thousand that need fixing
+        int z64;            // true for zip64 entries
+        unsigned clen;      // zip file comment length
+    } const kind[] = {
+        {16, 0, 0, 0}, {16, 10, 0, 0}, {200, 10, 0, 0}, {16, 10, 1, 0},
+        {16, 0, 0, MAX16}
+    };
+    char const *tmp = getenv("TMPDIR");
+    char dir[4096], path[4200], copy[4200];
+    snprintf(dir, sizeof(dir), "%s/zipclean-bench-XXXXXX",
+             tmp == NULL || *tmp == 0 ? "/tmp" : tmp);
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "zipclean: could not create %s\n", dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/bench.zip", dir);
+    snprintf(copy, sizeof(copy), "%s/fix.zip", dir);
+
+    int ret = 0;
+    printf("  entries nlen  bad%% type  comment       MB mode    entries/s"
+           "       MB/s calls/entry\n");
+    for (uint64_t n = 1; ret == 0 && n <= max; n *= 10)
+        for (size_t k = 0; ret == 0 && k < sizeof(kind) / sizeof(*kind); k++) {
+            off_t size = bench_make(path, n, kind[k].nlen, kind[k].bad,
+                                    kind[k].z64, kind[k].clen);
+            if (size == -1) {
+                fprintf(stderr, "zipclean: could not write %s\n", path);
+                ret = 1;
+                break;
+            }
+            for (int fix = 0; fix < 2; fix++) {
+                if (fix && bench_copy(path, copy)) {
+                    fprintf(stderr, "zipclean: could not write %s\n", copy);
+                    ret = 1;
+                    break;
+                }
+                job_t job = {.opt.fix = fix, .log = NULL, .fd = -1};
+                double start = now(), time;
+                do
+                    zip_clean(fix ? copy : path, 0, &job);
+                while (!fix && job.sum.files < 1000 &&
+                       (time = now() - start) < 0.2);
+                time = now() - start;
+                arena_free(&job.mem);
+                uintmax_t ents = job.sum.entries ? job.sum.entries : 1;
+                printf("%9ju %4u %4.1f%% %-5s %7u %8.1f %-4s %12.0f %10.1f"
+                       " %11.3f\n", (uintmax_t)n, kind[k].nlen,
+                       kind[k].bad / 10.,  kind[k].z64 ? "zip64" : "zip32",
+                       kind[k].clen, size / 1e6, fix ? "fix" : "scan",
+                       job.sum.entries / time, job.sum.bytes / time / 1e6,
+                       (double)tally_calls(&job.sum) / ents);
+                fflush(stdout);
+            }
+        }
+    unlink(copy);
+    unlink(path);
+    rmdir(dir);
+    return ret;
+}
+
+// Pathological inputs for worst(), each with the most milliseconds its 99th
+// percentile time is allowed to take.
+static struct {
+    char const *name;       // name of the case
+    double limit;           // hard limit on the 99th percentile, in ms
+} const worst_case[] = {
+    {"nonzip-4g", 5},       // 4 GB file without an end record
+    {"comment", 5},         // maximum-length zip file comment
+    {"false-end", 5},       // comment full of end record signatures
+    {"zip64-count", 5},     // zip64 end record claiming 2^64-1 entries
+    {"name-64k", 500},      // 256 entries with 64K names that need fixing
+    {"all-fixed", 500},     // 100,000 entries that all need fixing
+    {"many-1m", 2000}       // 1,000,000 entries, 1% needing fixing
+};
+#define WORST (sizeof(worst_case) / sizeof(*worst_case))
+
+// Overwrite the len bytes at offset at from the end of the file path with
+// buf[0..len-1]. Return 0 on success, or -1 on error.
+static int worst_poke(char const *path, off_t at, unsigned char const *buf,
+                      size_t len) {
+    FILE *out = fopen(path, "r+b");
+    if (out == NULL)
+        return -1;
+    int ret = fseeko(out, -at, SEEK_END) || fwrite(buf, 1, len, out) != len;
+    return fclose(out) || ret ? -1 : 0;
+}
+
+// Write the input for worst_case[k] to path. Return 0 on success, or -1 on
+// error.
+static int worst_make(size_t k, char const *path) {
+    unsigned char buf[MAX16];
+    switch (k) {
+    case 0: {
+        // Sparse, so that it takes no time or space to make.
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+            return -1;
+        int ret = ftruncate(fd, (off_t)1 << 32);
+        return close(fd) || ret ? -1 : 0;
+    }
+    case 1:
+        return bench_make(path, 1000, 16, 0, 0, MAX16) == -1 ? -1 : 0;
+    case 2:
+        if (bench_make(path, 1000, 16, 0, 0, MAX16) == -1)
+            return -1;
+        for (size_t i = 0; i + 4 <= MAX16; i += 4)
+            set4(buf + i, END);
+        return worst_poke(path, MAX16, buf, MAX16 & ~3);
+    case 3:
+        if (bench_make(path, 1, 16, 0, 1, 0) == -1)
+            return -1;
+        memset(buf, 0xff, 16);
+        return worst_poke(path, ENDLEN + ZLOCLEN + 56 - 24, buf, 16);
+    case 4:
+        return bench_make(path, 256, MAX16, 1000, 0, 0) == -1 ? -1 : 0;
+    case 5:
+        return bench_make(path, 100000, 16, 1000, 0, 0) == -1 ? -1 : 0;
+    default:
+        return bench_make(path, 1000000, 16, 10, 0, 0) == -1 ? -1 : 0;
+    }
+}
+
+// Results for one worst() case.
+typedef struct {
+    double p50, p99;        // median and 99th percentile times, in ms
+    uintmax_t runs;         // number of runs timed
+    int err;                // true if the input was rejected as an error
+    double rss;             // peak resident memory, in MB
+} worst_t;
+
+// Compare two doubles, for qsort().
+static int by_time(void const *a, void const *b) {
+    double x = *(double const *)a, y = *(double const *)b;
+    return (x > y) - (x < y);
+}
+
+// Time zip_clean() checking path in a child process, so that its peak memory
+// is for just this case. The input is checked at least ten times, and for at
+// least half a second, up to 1000 times. Return 0 on success, or -1 on error.
+static int worst_run(char const *path, worst_t *res) {
+    int pipe_fd[2];
+    if (pipe(pipe_fd))
+        return -1;
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        static double time[1000];
+        job_t job = {.opt.json = 1, .log = NULL, .fd = -1};
+        worst_t got = {0};
+        double start = now();
+        size_t n = 0;
+        do {
+            double beg = now();
+            zip_clean((char *)path, 0, &job);
+            time[n++] = (now() - beg) * 1000;
+        } while (n < 1000 && (n < 10 || now() - start < 0.5));
+        qsort(time, n, sizeof(double), by_time);
+        got.p50 = time[n / 2];
+        got.p99 = time[n * 99 / 100];
+        got.runs = n;
+        got.err = job.sum.errors != 0;
+        _exit(write(pipe_fd[1], &got, sizeof(got)) != sizeof(got));
+    }
+    close(pipe_fd[1]);
+    ssize_t got = read(pipe_fd[0], res, sizeof(worst_t));
+    close(pipe_fd[0]);
+    int status;
+    struct rusage use;
+    if (wait4(pid, &status, 0, &use) == -1 || !WIFEXITED(status) ||
+        WEXITSTATUS(status) || got != sizeof(worst_t))
+        return -1;
+#ifdef __APPLE__
+    res->rss = use.ru_maxrss / 1e6;         // bytes
+#else
+    res->rss = use.ru_maxrss / 1e3;         // kilobytes
+#endif
+    return 0;
+}
+
+// Run zip_clean() on worst_case[] pathological inputs, reporting the median
+// and 99th percentile times and peak memory of each. A case fails if its 99th
+// percentile time is over its hard limit. If base is not NULL, then it is a
+// file of the results from before. If it doesn't exist, then it is written
+// with these results. Otherwise a case also fails if its 99th percentile time
+// is more than twice that in base plus a millisecond, or its peak memory more
+// than 1.5 times that plus 4 MB. The inputs are written to a temporary
+// directory in $TMPDIR, or /tmp. Return 0 if all cases pass, or 1 if not.
+static int worst(char const *base) {
+    // Load the results from before, if any.
+    worst_t was[WORST];
+    int have[WORST] = {0};
+    FILE *in = base == NULL ? NULL : fopen(base, "r");
+    if (in != NULL) {
+        char name[64];
+        worst_t res;
+        while (fscanf(in, "%63s %lf %lf %lf", name, &res.p50, &res.p99,
+                      &res.rss) == 4)
+            for (size_t k = 0; k < WORST; k++)
+                if (strcmp(name, worst_case[k].name) == 0) {
+                    was[k] = res;
+                    have[k] = 1;
+                }
+        fclose(in);
+    }
+
+    char const *tmp = getenv("TMPDIR");
+    char dir[4096], path[4200];
+    snprintf(dir, sizeof(dir), "%s/zipclean-worst-XXXXXX",
+             tmp == NULL || *tmp == 0 ? "/tmp" : tmp);
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "zipclean: could not create %s\n", dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/worst.zip", dir);
+
+    // Run the cases.
+    int ret = 0;
+    worst_t res[WORST];
+    printf("case         runs   p50 ms   p99 ms limit ms   RSS MB zip   "
+           "result\n");
+    for (size_t k = 0; k < WORST; k++) {
+        if (worst_make(k, path) || worst_run(path, res + k)) {
+            fprintf(stderr, "zipclean: could not run %s in %s\n",
+                    worst_case[k].name, dir);
+            ret = 1;
+            break;
+        }
+        worst_t const *r = res + k;
+        char const *result = "ok";
+        if (r->p99 > worst_case[k].limit)
+            result = "FAIL (over limit)";
+        else if (have[k] && r->p99 > 2 * was[k].p99 + 1)
+            result = "FAIL (slower)";
+        else if (have[k] && r->rss > 1.5 * was[k].rss + 4)
+            result = "FAIL (more memory)";
+        if (strcmp(result, "ok"))
+            ret = 1;
+        printf("%-12s %4ju %8.3f %8.3f %8.0f %8.1f %-5s %s\n",
+               worst_case[k].name, r->runs, r->p50, r->p99,
+               worst_case[k].limit, r->rss, r->err ? "error" : "ok", result);
+        fflush(stdout);
+        unlink(path);
+    }
+    rmdir(dir);
+
+    // Save the results if there were none before.
+    if (base != NULL && ret == 0 && access(base, F_OK)) {
+        FILE *out = fopen(base, "w");
+        for (size_t k = 0; out != NULL && k < WORST; k++)
+            fprintf(out, "%s %.6f %.6f %.3f\n", worst_case[k].name,
+                    res[k].p50, res[k].p99, res[k].rss);
+        if (out == NULL || fclose(out)) {
+            fprintf(stderr, "zipclean: could not write %s\n", base);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+// Process all of the zip files on the command line, fixing them if the -f
+// option is given. By default, the files are untouched, and changes that would
+// be made are only reported. If the -- option is given, subsequent file names
+// can start with a dash, and won't be treated as invalid options. The other
+// options are listed in the usage text, and described in README.md.
+int main(int argc, char **argv) {
+    // Process options, and collect the paths in argv[1..paths].
+    work_t work = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                   .more = PTHREAD_COND_INITIALIZER};
+    work.tail = &work.head;
+    long jobs = 1;
+    int opt = 1, tree = 0, stream = 0, paths = 0;
+    char *cache = NULL, *undoing = NULL, *serving = NULL;
+    int grow = 0;
+    for (int i = 1; i < argc; i++)
+        if (opt && argv[i][0] == '-') {
+            if (strcmp(argv[i] + 1, "f") == 0)
+                work.opt.fix = 1;
+            else if (strcmp(argv[i] + 1, "r") == 0)
+                tree = 1;
+            else if (strcmp(argv[i] + 1, "s") == 0)
+                stream = 1;
+            else if (strcmp(argv[i] + 1, "v") == 0 ||
+                     strcmp(argv[i], "--stats") == 0)
+                work.opt.stats = 1;
+            else if (strcmp(argv[i], "--json") == 0)
+                work.opt.json = 1;
+            else if (strcmp(argv[i] + 1, "q") == 0)
+                work.opt.quick = 1;
+            else if (strcmp(argv[i], "--verify") == 0)
+                work.opt.verify = 1;
+            else if (strcmp(argv[i], "--overlap") == 0)
+                work.opt.overlap = 1;
+            else if (strcmp(argv[i], "--collisions") == 0)
+                work.opt.collide = 1;
+            else if (strcmp(argv[i], "--drop") == 0)
+                work.opt.drop = 1;
+            else if (strcmp(argv[i], "--direct") == 0)
+                work.opt.direct = 1;
+            else if (strcmp(argv[i] + 1, "o") == 0) {
+                if (i + 1 == argc) {
+                    fputs("-o needs a file name\n", stderr);
+                    return 1;
+                }
+                work.opt.copy = argv[++i];
+                work.opt.fix = 1;
+            }
+            else if (strcmp(argv[i], "--journal") == 0 ||
+                     strcmp(argv[i], "--undo") == 0) {
+                if (i + 1 == argc) {
+                    fprintf(stderr, "%s needs a file name\n", argv[i]);
+                    return 1;
+                }
+                if (argv[i][2] == 'u')
+                    undoing = argv[++i];
+                else
+                    journal.path = argv[++i];
+            }
+            else if (strcmp(argv[i], "--cache") == 0) {
+                if (i + 1 == argc) {
+                    fputs("--cache needs a file name\n", stderr);
+                    return 1;
+                }
+                cache = argv[++i];
+            }
+            else if (strcmp(argv[i], "--incremental") == 0)
+                grow = 1;
+            else if (strcmp(argv[i], "--serve") == 0) {
+                if (i + 1 == argc) {
+                    fputs("--serve needs a socket path\n", stderr);
+                    return 1;
+                }
+                serving = argv[++i];
+            }
+            else if (strncmp(argv[i], "--max-entries=", 14) == 0 ||
+                     strncmp(argv[i], "--max-bytes=", 12) == 0) {
+                char *arg = strchr(argv[i], '=') + 1, *end;
+                uintmax_t most = strtoumax(arg, &end, 10);
+                if (*arg == 0 || *end || most < 1) {
+                    fprintf(stderr, "invalid %.*s value %s\n",
+                            (int)(arg - 1 - argv[i]), argv[i], arg);
+                    return 1;
+                }
+                if (argv[i][6] == 'e')
+                    work.opt.max.entries = most;
+                else
+                    work.opt.max.bytes = most;
+            }
+            else if (strncmp(argv[i], "--max-time=", 11) == 0) {
+                char *arg = argv[i] + 11, *end;
+                double most = strtod(arg, &end);
+                if (*arg == 0 || *end || !(most > 0)) {
+                    fprintf(stderr, "invalid --max-time value %s\n", arg);
+                    return 1;
+                }
+                work.opt.max.time = most;
+            }
+            else if (strncmp(argv[i], "--depth=", 8) == 0) {
+                char *arg = argv[i] + 8, *end;
+                uintmax_t depth = strtoumax(arg, &end, 10);
+                if (*arg == 0 || *end || depth > 65536) {
+                    fprintf(stderr, "invalid --depth value %s\n", arg);
+                    return 1;
+                }
+                work.depth = depth;
+                work.opt.hint = depth != 0;
+            }
+            else if (argv[i][1] == 'j') {
+                char *arg = argv[i][2] ? argv[i] + 2 :
+                            i + 1 < argc ? argv[++i] : "", *end;
+                jobs = strtol(arg, &end, 10);
+                if (*arg == 0 || *end || jobs < 1 || jobs > 1024) {
+                    fprintf(stderr, "invalid -j value %s\n", arg);
+                    return 1;
+                }
+            }
+            else if (strncmp(argv[i], "--bench", 7) == 0 &&
+                     (argv[i][7] == 0 || argv[i][7] == '=')) {
+                char *arg = argv[i][7] ? argv[i] + 8 : "100000", *end;
+                uintmax_t max = strtoumax(arg, &end, 10);
+                if (*arg == 0 || *end || max < 1) {
+                    fprintf(stderr, "invalid --bench value %s\n", arg);
+                    return 1;
+                }
+                return bench(max);
+            }
+            else if (strncmp(argv[i], "--worst", 7) == 0 &&
+                     (argv[i][7] == 0 || argv[i][7] == '=')) {
+                if (argv[i][7] && argv[i][8] == 0) {
+                    fputs("--worst= needs a file name\n", stderr);
+                    return 1;
+                }
+                return worst(argv[i][7] ? argv[i] + 8 : NULL);
+            }
+            else if (strcmp(argv[i] + 1, "-") == 0)
+                opt = 0;
+            else {
+                fprintf(stderr, "unknown option %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+            argv[++paths] = argv[i];
+
+    int checks = work.opt.verify || work.opt.overlap || work.opt.collide;
+    if (work.opt.quick && (work.opt.fix || stream || checks)) {
+        fputs("-q cannot be used with -f, -o, -s, --verify, --overlap, or "
+              "--collisions\n", stderr);
+        return 1;
+    }
+    if (stream && checks) {
+        fputs("--verify, --overlap, and --collisions cannot be used with -s\n",
+              stderr);
+        return 1;
+    }
+    if (serving != NULL && (paths || tree || stream || work.opt.copy != NULL ||
+                            undoing != NULL)) {
+        fputs("no zip files, -r, -s, -o, or --undo allowed with --serve\n",
+              stderr);
+        return 1;
+    }
+    if (work.opt.copy != NULL && (paths != 1 || tree || stream || cache)) {
+        fputs("-o needs exactly one zip file, and no -r, -s, or --cache\n",
+              stderr);
+        return 1;
+    }
+
+    // Clean a zip file from stdin to stdout.
+    if (stream) {
+        if (paths) {
+            fputs("no zip file arguments allowed with -s\n", stderr);
+            return 1;
+        }
+        arena_t mem = {0};
+        int ret = zip_stream(&mem, work.opt.stats, work.opt.json);
+        arena_free(&mem);
+        return ret;
+    }
+
+    // Undo the changes in a journal, if requested.
+    if (undoing != NULL) {
+        if (paths || journal.path != NULL) {
+            fputs("no zip files or --journal allowed with --undo\n", stderr);
+            return 1;
+        }
+        return undo(undoing);
+    }
+
+    // Open the journal, if requested.
+    if (journal.path != NULL) {
+        if (!work.opt.fix || work.opt.copy != NULL) {
+            fputs("--journal is only for -f\n", stderr);
+            return 1;
+        }
+        journal.fd = open(journal.path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (journal.fd == -1) {
+            fprintf(stderr, "zipclean: could not open journal %s (%s)\n",
+                    journal.path, strerror(errno));
+            return 1;
+        }
+        pthread_once(&crc_once, crc_make);
+        work.opt.keep = 1;
+    }
+
+    // Load the cache, if requested.
+    if (grow && cache == NULL) {
+        fputs("--incremental needs --cache\n", stderr);
+        return 1;
+    }
+    if (cache != NULL && (work.cache = cache_open(cache)) == NULL)
+        return 1;
+    if (work.cache != NULL)
+        work.cache->grow = grow;
+
+    // Serve requests on a socket instead, if requested.
+    if (serving != NULL)
+        return serve(&work, serving, jobs);
+
+    // Queue the zip files and directories, in order.
+    for (int i = 1; i <= paths; i++) {
+        struct stat st;
+        enqueue(&work, tree && stat(argv[i], &st) == 0 &&
+                       S_ISDIR(st.st_mode) ? TREE : ZIP,
+                argv[i], strlen(argv[i]), NULL);
+    }
+
+    // Process the queue using jobs threads, one of which is this one. Workers
+    // list the queued directories as they get to them, so walking the trees
+    // overlaps with processing the zip files found so far. A zip file with a
+    // large central directory is scanned using up to jobs threads of its own.
+    work.opt.split = jobs;
+    pthread_t *tid = jobs > 1 ? malloc((jobs - 1) * sizeof(pthread_t)) : NULL;
+    long started = 0;
+    if (tid != NULL)
+        while (started < jobs - 1 &&
+               pthread_create(tid + started, NULL, worker, &work) == 0)
+            started++;
+    double start = now();
+    worker(&work);
+    while (started)
+        pthread_join(tid[--started], NULL);
+    free(tid);
+
+    // Report the totals, if requested.
+    if (work.opt.stats) {
+        char line[512];
+        tally_line(line, sizeof(line), &work.total, work.opt.json);
+        printf(work.opt.json ?
+               "{\"total\":%ju,\"cached\":%ju,\"bytes\":%ju,%s,"
+               "\"elapsed\":%.6f}\n" :
+               "total: %ju zip files (%ju cached), %ju bytes, %s, "
+               "%.6f s elapsed\n",
+               work.total.files, work.total.cached, work.total.bytes, line,
+               now() - start);
+    }
+    if (work.cache != NULL)
+        cache_close(work.cache);
+    if (work.opt.quick)
+        return work.total.errors ? 2 : work.total.fixed ? 1 : 0;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,50 @@
+/* zipclean.h -- interface to the zipclean library
+ * Copyright (C) 2023 Mark Adler
+ * For conditions of distribution and use, see copyright notice in zipclean.c
+ */
+
+#ifndef ZIPCLEAN_H
+#define ZIPCLEAN_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Flags for zipclean_buffer().
+#define ZIPCLEAN_FIX 1              // replace the names in the buffer
+
+// Error returns from zipclean_buffer().
+#define ZIPCLEAN_EZIP (-1)          // not a zip file, or an invalid one
+#define ZIPCLEAN_EMEM (-2)          // out of memory
+
+// Function called for each name that needs fixing. name[0..len-1] is the
+// original name, and repl[0..len-1] is the replacement. Neither is terminated
+// with a nul. Both are only valid for the duration of the call -- name points
+// into the caller's buffer, which is overwritten with the replacement after
+// the call returns if ZIPCLEAN_FIX is given. opaque is as provided to
+// zipclean_buffer().
+typedef void zipclean_report_t(void *opaque, unsigned char const *name,
+                               unsigned char const *repl, size_t len);
+
+// Check the zip file in data[0..len-1] for names that would be extracted
+// outside of the destination directory. If flags has ZIPCLEAN_FIX, then
+// replace those names in data[] in both the central and local headers. If
+// report is not NULL, then it is called for each such name, in central
+// directory order, after the local headers have been checked and replaced, but
+// before the central directory names are. Return the number of names found to
+// need fixing, or a negative ZIPCLEAN_E* error, in which case data[] is not
+// modified and report is not called. zipclean_buffer() is thread safe, and may
+// be called on different buffers at the same time.
+int zipclean_buffer(void *data, size_t len, int flags,
+                    zipclean_report_t *report, void *opaque);
+
+// Return a description of the zipclean_buffer() return value err.
+char const *zipclean_error(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif